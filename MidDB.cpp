@@ -7,9 +7,27 @@
 #include <mutex>
 #include <shared_mutex>
 #include <queue>
+#include <set>
 #include <condition_variable>
 #include <thread>
+#include <atomic>
+#include <map>
+#include <array>
 #include <filesystem>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <functional>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#ifdef MIDDB_IO_URING
+#include <liburing.h>
+#endif
 #include "httplib.h"
 #include "json.hpp"
 #include "hnswlib/hnswlib.h"
@@ -18,345 +36,4802 @@ using namespace std;
 using json = nlohmann::json;
 namespace fs = std::filesystem;
 
-// --- Data Structures ---
-struct Record {
-    unordered_map<string,string> fields;
-    vector<float> embedding;
-    size_t label;
+// Structured field index: fieldName -> fieldValue -> set(recordIDs)
+using FieldIndex = unordered_map<string, unordered_map<string, unordered_set<string>>>;
+
+// Namespaces stay on a flat (exact) index until they reach this size, then move to HNSW
+constexpr size_t NAMESPACE_FLAT_LIMIT = 1000;
+
+// Checkpoints reorder a table's HNSW graphs once they reach this many nodes and have doubled
+// since the last reorder
+constexpr size_t REORDER_MIN_NODES = 10000;
+
+// ef auto-tuning for tables with a recallTarget: checked every TUNE_INTERVAL and re-run once
+// the default namespace has grown by half since the last run
+constexpr size_t TUNE_MIN_RECORDS = 1000, TUNE_SAMPLES = 200;
+constexpr chrono::seconds TUNE_INTERVAL{60};
+
+// --- Distance kernels ---
+// hnswlib picks its SIMD path at compile time, so a portable build runs scalar/SSE code.
+// MidDB's kernels are compiled for every ISA with target attributes and chosen at startup.
+enum class Precision { FP32, FP16, BF16 };
+enum class Metric { L2, IP, Cosine }; // cosine = IP over unit-normalized vectors
+enum class Isa { Scalar, SSE, AVX2, AVX512 };
+
+static const char *isaName(Isa isa) {
+    return isa == Isa::AVX512 ? "avx512" : isa == Isa::AVX2 ? "avx2" : isa == Isa::SSE ? "sse" : "scalar";
+}
+
+// Best ISA of the running CPU, optionally capped by MIDDB_SIMD=scalar|sse|avx2|avx512
+static Isa detectIsa() {
+    Isa isa = Isa::Scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    isa = Isa::SSE;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) isa = Isa::AVX2;
+    if (__builtin_cpu_supports("avx512f")) isa = Isa::AVX512;
+#endif
+    if (const char *cap = getenv("MIDDB_SIMD")) {
+        for (Isa c : {Isa::Scalar, Isa::SSE, Isa::AVX2, Isa::AVX512})
+            if (string(cap) == isaName(c) && c < isa) isa = c;
+    }
+    return isa;
+}
+static const Isa cpuIsa = detectIsa();
+
+static uint16_t floatToHalf(float f) {
+    uint32_t x; memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000, exp = (x >> 23) & 0xFF, mant = x & 0x7FFFFF;
+    if (exp == 0xFF) return sign | 0x7C00 | (mant ? 0x200 : 0); // inf / nan
+    int e = (int)exp - 127 + 15;
+    if (e >= 0x1F) return sign | 0x7C00;                      // overflow to inf
+    if (e <= 0) {                                             // subnormal or zero
+        if (e < -10) return sign;
+        mant |= 0x800000;
+        uint32_t shift = 14 - e, half = mant >> shift, rem = mant & ((1u << shift) - 1), mid = 1u << (shift - 1);
+        if (rem > mid || (rem == mid && (half & 1))) half++;
+        return sign | half;
+    }
+    uint32_t half = sign | (e << 10) | (mant >> 13), rem = mant & 0x1FFF;
+    if (rem > 0x1000 || (rem == 0x1000 && (half & 1))) half++; // round to nearest even
+    return half;
+}
+
+static float halfToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16, exp = (h >> 10) & 0x1F, mant = h & 0x3FF, x;
+    if (exp == 0x1F) x = sign | 0x7F800000 | (mant << 13);
+    else if (exp) x = sign | ((exp + 112) << 23) | (mant << 13);
+    else if (!mant) x = sign;
+    else {
+        int e = -1;
+        do { e++; mant <<= 1; } while (!(mant & 0x400));
+        x = sign | ((112 - e) << 23) | ((mant & 0x3FF) << 13);
+    }
+    float f; memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static uint16_t floatToBf16(float f) {
+    uint32_t x; memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7FFFFFFF) > 0x7F800000) return 0x7FC0;        // nan
+    x += 0x7FFF + ((x >> 16) & 1);                             // round to nearest even
+    return x >> 16;
+}
+
+static float bf16ToFloat(uint16_t h) {
+    uint32_t x = (uint32_t)h << 16;
+    float f; memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static vector<uint16_t> packEmbedding(const vector<float> &embedding, Precision precision) {
+    vector<uint16_t> out(embedding.size());
+    for (size_t i = 0; i < embedding.size(); i++)
+        out[i] = precision == Precision::BF16 ? floatToBf16(embedding[i]) : floatToHalf(embedding[i]);
+    return out;
+}
+
+static vector<float> unpackEmbedding(const vector<uint16_t> &packed, Precision precision) {
+    vector<float> out(packed.size());
+    for (size_t i = 0; i < packed.size(); i++)
+        out[i] = precision == Precision::BF16 ? bf16ToFloat(packed[i]) : halfToFloat(packed[i]);
+    return out;
+}
+
+template<Precision P> using Elem = conditional_t<P == Precision::FP32, float, uint16_t>;
+
+template<Precision P> static inline float toFloat(Elem<P> v) {
+    if constexpr (P == Precision::FP32) return v;
+    else if constexpr (P == Precision::FP16) return halfToFloat(v);
+    else return bf16ToFloat(v);
+}
+
+// Kernels return squared L2, or 1 - dot for IP (hnswlib's convention). DIM > 0 fixes the
+// dimension at compile time so loops fully unroll and the remainder loop disappears.
+template<Precision P, bool IP, size_t DIM>
+static float distScalar(const void *a, const void *b, const void *param) {
+    auto x = static_cast<const Elem<P>*>(a), y = static_cast<const Elem<P>*>(b);
+    const size_t dim = DIM ? DIM : *static_cast<const size_t*>(param);
+    float sum = 0;
+    for (size_t i = 0; i < dim; i++) {
+        float u = toFloat<P>(x[i]), v = toFloat<P>(y[i]);
+        sum += IP ? u * v : (u - v) * (u - v);
+    }
+    return IP ? 1.0f - sum : sum;
+}
+
+#if defined(__x86_64__)
+// Each kernel's main loop is written twice: with a compile-time DIM the `unroll` pragma
+// flattens it completely, with a runtime dim it stays a plain loop.
+template<bool IP>
+static inline void stepSse(const float *x, const float *y, __m128 &acc) {
+    __m128 u = _mm_loadu_ps(x), v = _mm_loadu_ps(y);
+    if (IP) acc = _mm_add_ps(acc, _mm_mul_ps(u, v));
+    else { __m128 d = _mm_sub_ps(u, v); acc = _mm_add_ps(acc, _mm_mul_ps(d, d)); }
+}
+
+template<bool IP, size_t DIM>
+static float distSse(const void *a, const void *b, const void *param) {
+    auto x = static_cast<const float*>(a), y = static_cast<const float*>(b);
+    const size_t dim = DIM ? DIM : *static_cast<const size_t*>(param);
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    if constexpr (DIM != 0) {
+#pragma GCC unroll 256
+        for (; i + 8 <= dim; i += 8) { stepSse<IP>(x + i, y + i, acc0); stepSse<IP>(x + i + 4, y + i + 4, acc1); }
+    } else {
+        for (; i + 8 <= dim; i += 8) { stepSse<IP>(x + i, y + i, acc0); stepSse<IP>(x + i + 4, y + i + 4, acc1); }
+    }
+    float lanes[4], sum = 0;
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    for (float v : lanes) sum += v;
+    if constexpr (DIM == 0 || DIM % 8 != 0)
+        for (; i < dim; i++) sum += IP ? x[i] * y[i] : (x[i] - y[i]) * (x[i] - y[i]);
+    return IP ? 1.0f - sum : sum;
+}
+
+template<Precision P>
+__attribute__((target("avx2,fma,f16c"))) static inline __m256 load8(const Elem<P> *p) {
+    if constexpr (P == Precision::FP32) return _mm256_loadu_ps(p);
+    else if constexpr (P == Precision::FP16) return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p));
+    else return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p)), 16));
+}
+
+template<bool IP>
+__attribute__((target("avx2,fma"))) static inline void fmaAvx2(__m256 u, __m256 v, __m256 &acc) {
+    if (IP) acc = _mm256_fmadd_ps(u, v, acc);
+    else { __m256 d = _mm256_sub_ps(u, v); acc = _mm256_fmadd_ps(d, d, acc); }
+}
+
+template<Precision P, bool IP>
+__attribute__((target("avx2,fma,f16c"))) static inline void stepAvx2(const Elem<P> *x, const Elem<P> *y, __m256 &acc) {
+    fmaAvx2<IP>(load8<P>(x), load8<P>(y), acc);
+}
+
+template<Precision P, bool IP, size_t DIM>
+__attribute__((target("avx2,fma,f16c")))
+static float distAvx2(const void *a, const void *b, const void *param) {
+    auto x = static_cast<const Elem<P>*>(a), y = static_cast<const Elem<P>*>(b);
+    const size_t dim = DIM ? DIM : *static_cast<const size_t*>(param);
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    if constexpr (DIM != 0) {
+#pragma GCC unroll 256
+        for (; i + 16 <= dim; i += 16) { stepAvx2<P, IP>(x + i, y + i, acc0); stepAvx2<P, IP>(x + i + 8, y + i + 8, acc1); }
+    } else {
+        for (; i + 16 <= dim; i += 16) { stepAvx2<P, IP>(x + i, y + i, acc0); stepAvx2<P, IP>(x + i + 8, y + i + 8, acc1); }
+    }
+    for (; i + 8 <= dim; i += 8) stepAvx2<P, IP>(x + i, y + i, acc0);
+    float lanes[8], sum = 0;
+    _mm256_storeu_ps(lanes, _mm256_add_ps(acc0, acc1));
+    _mm256_zeroupper();  // callers are plain SSE code; avoid the AVX->SSE transition stall
+    for (float v : lanes) sum += v;
+    for (; i < dim; i++) {
+        float u = toFloat<P>(x[i]), v = toFloat<P>(y[i]);
+        sum += IP ? u * v : (u - v) * (u - v);
+    }
+    return IP ? 1.0f - sum : sum;
+}
+
+template<Precision P>
+__attribute__((target("avx512f"))) static inline __m512 load16(const Elem<P> *p) {
+    if constexpr (P == Precision::FP32) return _mm512_loadu_ps(p);
+    else if constexpr (P == Precision::FP16) return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)p));
+    else return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)p)), 16));
+}
+
+template<bool IP>
+__attribute__((target("avx512f"))) static inline void fmaAvx512(__m512 u, __m512 v, __m512 &acc) {
+    if (IP) acc = _mm512_fmadd_ps(u, v, acc);
+    else { __m512 d = _mm512_sub_ps(u, v); acc = _mm512_fmadd_ps(d, d, acc); }
+}
+
+template<Precision P, bool IP>
+__attribute__((target("avx512f"))) static inline void stepAvx512(const Elem<P> *x, const Elem<P> *y, __m512 &acc) {
+    fmaAvx512<IP>(load16<P>(x), load16<P>(y), acc);
+}
+
+template<Precision P, bool IP, size_t DIM>
+__attribute__((target("avx512f")))
+static float distAvx512(const void *a, const void *b, const void *param) {
+    auto x = static_cast<const Elem<P>*>(a), y = static_cast<const Elem<P>*>(b);
+    const size_t dim = DIM ? DIM : *static_cast<const size_t*>(param);
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    if constexpr (DIM != 0) {
+#pragma GCC unroll 256
+        for (; i + 32 <= dim; i += 32) { stepAvx512<P, IP>(x + i, y + i, acc0); stepAvx512<P, IP>(x + i + 16, y + i + 16, acc1); }
+    } else {
+        for (; i + 32 <= dim; i += 32) { stepAvx512<P, IP>(x + i, y + i, acc0); stepAvx512<P, IP>(x + i + 16, y + i + 16, acc1); }
+    }
+    for (; i + 16 <= dim; i += 16) stepAvx512<P, IP>(x + i, y + i, acc0);
+    float lanes[16], sum = 0;
+    _mm512_storeu_ps(lanes, _mm512_add_ps(acc0, acc1));
+    _mm256_zeroupper();
+    for (float v : lanes) sum += v;
+    for (; i < dim; i++) {
+        float u = toFloat<P>(x[i]), v = toFloat<P>(y[i]);
+        sum += IP ? u * v : (u - v) * (u - v);
+    }
+    return IP ? 1.0f - sum : sum;
+}
+
+// Batched variants: one pass over the query feeds four accumulators, one per candidate.
+// Lane j of hsum4's result is the total of accumulator j.
+__attribute__((target("avx2"))) static inline __m128 hsum4(__m256 a0, __m256 a1, __m256 a2, __m256 a3) {
+    __m256 s = _mm256_hadd_ps(_mm256_hadd_ps(a0, a1), _mm256_hadd_ps(a2, a3));
+    return _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+}
+
+__attribute__((target("avx512f"))) static inline __m256 fold512(__m512 a) {
+    return _mm256_add_ps(_mm512_castps512_ps256(a), _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(a), 1)));
+}
+
+// Scalar tail from `from` to dim, then the metric's final form. Tail is false for compile-time
+// dimensions the vector loop covers completely.
+template<Precision P, bool IP, bool Tail>
+static inline void finishBatch(const Elem<P> *x, const void *const *xs, size_t from, size_t dim, const float *sums, float *out) {
+    for (int j = 0; j < 4; j++) {
+        auto y = static_cast<const Elem<P>*>(xs[j]);
+        float sum = sums[j];
+        if constexpr (Tail)
+            for (size_t t = from; t < dim; t++) {
+                float u = toFloat<P>(x[t]), v = toFloat<P>(y[t]);
+                sum += IP ? u * v : (u - v) * (u - v);
+            }
+        out[j] = IP ? 1.0f - sum : sum;
+    }
+}
+
+template<Precision P, bool IP, size_t DIM>
+__attribute__((target("avx2,fma,f16c")))
+static void batchAvx2(const void *q, const void *const *xs, float *out, size_t runtimeDim) {
+    const size_t dim = DIM ? DIM : runtimeDim;
+    auto x = static_cast<const Elem<P>*>(q);
+    auto y0 = static_cast<const Elem<P>*>(xs[0]), y1 = static_cast<const Elem<P>*>(xs[1]);
+    auto y2 = static_cast<const Elem<P>*>(xs[2]), y3 = static_cast<const Elem<P>*>(xs[3]);
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(), acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+    size_t i = 0;
+    if constexpr (DIM != 0) {
+#pragma GCC unroll 64
+        for (; i + 8 <= dim; i += 8) {
+            __m256 u = load8<P>(x + i);
+            fmaAvx2<IP>(u, load8<P>(y0 + i), acc0); fmaAvx2<IP>(u, load8<P>(y1 + i), acc1);
+            fmaAvx2<IP>(u, load8<P>(y2 + i), acc2); fmaAvx2<IP>(u, load8<P>(y3 + i), acc3);
+        }
+    } else {
+        for (; i + 8 <= dim; i += 8) {
+            __m256 u = load8<P>(x + i);
+            fmaAvx2<IP>(u, load8<P>(y0 + i), acc0); fmaAvx2<IP>(u, load8<P>(y1 + i), acc1);
+            fmaAvx2<IP>(u, load8<P>(y2 + i), acc2); fmaAvx2<IP>(u, load8<P>(y3 + i), acc3);
+        }
+    }
+    float sums[4];
+    _mm_storeu_ps(sums, hsum4(acc0, acc1, acc2, acc3));
+    _mm256_zeroupper();
+    finishBatch<P, IP, DIM == 0 || DIM % 8 != 0>(x, xs, i, dim, sums, out);
+}
+
+template<Precision P, bool IP, size_t DIM>
+__attribute__((target("avx512f")))
+static void batchAvx512(const void *q, const void *const *xs, float *out, size_t runtimeDim) {
+    const size_t dim = DIM ? DIM : runtimeDim;
+    auto x = static_cast<const Elem<P>*>(q);
+    auto y0 = static_cast<const Elem<P>*>(xs[0]), y1 = static_cast<const Elem<P>*>(xs[1]);
+    auto y2 = static_cast<const Elem<P>*>(xs[2]), y3 = static_cast<const Elem<P>*>(xs[3]);
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps(), acc2 = _mm512_setzero_ps(), acc3 = _mm512_setzero_ps();
+    size_t i = 0;
+    if constexpr (DIM != 0) {
+#pragma GCC unroll 64
+        for (; i + 16 <= dim; i += 16) {
+            __m512 u = load16<P>(x + i);
+            fmaAvx512<IP>(u, load16<P>(y0 + i), acc0); fmaAvx512<IP>(u, load16<P>(y1 + i), acc1);
+            fmaAvx512<IP>(u, load16<P>(y2 + i), acc2); fmaAvx512<IP>(u, load16<P>(y3 + i), acc3);
+        }
+    } else {
+        for (; i + 16 <= dim; i += 16) {
+            __m512 u = load16<P>(x + i);
+            fmaAvx512<IP>(u, load16<P>(y0 + i), acc0); fmaAvx512<IP>(u, load16<P>(y1 + i), acc1);
+            fmaAvx512<IP>(u, load16<P>(y2 + i), acc2); fmaAvx512<IP>(u, load16<P>(y3 + i), acc3);
+        }
+    }
+    float sums[4];
+    _mm_storeu_ps(sums, hsum4(fold512(acc0), fold512(acc1), fold512(acc2), fold512(acc3)));
+    _mm256_zeroupper();
+    finishBatch<P, IP, DIM == 0 || DIM % 16 != 0>(x, xs, i, dim, sums, out);
+}
+#endif
+
+// Distances from one query to four stored vectors
+using BatchDistFunc = void (*)(const void *query, const void *const *xs, float *out, size_t dim);
+
+template<Precision P, bool IP, size_t DIM>
+static BatchDistFunc batchKernelFor(Isa isa) {
+#if defined(__x86_64__)
+    if (isa == Isa::AVX512) return batchAvx512<P, IP, DIM>;
+    if (isa == Isa::AVX2) return batchAvx2<P, IP, DIM>;
+#endif
+    return nullptr;
+}
+
+template<size_t DIM>
+static BatchDistFunc batchKernelFor(Precision precision, Metric metric, Isa isa) {
+    bool ip = metric != Metric::L2;
+    switch (precision) {
+        case Precision::FP16: return ip ? batchKernelFor<Precision::FP16, true, DIM>(isa) : batchKernelFor<Precision::FP16, false, DIM>(isa);
+        case Precision::BF16: return ip ? batchKernelFor<Precision::BF16, true, DIM>(isa) : batchKernelFor<Precision::BF16, false, DIM>(isa);
+        default: return ip ? batchKernelFor<Precision::FP32, true, DIM>(isa) : batchKernelFor<Precision::FP32, false, DIM>(isa);
+    }
+}
+
+template<Precision P, bool IP, size_t DIM>
+static hnswlib::DISTFUNC<float> kernelFor(Isa isa) {
+#if defined(__x86_64__)
+    if (isa == Isa::AVX512) return distAvx512<P, IP, DIM>;
+    if (isa == Isa::AVX2) return distAvx2<P, IP, DIM>;
+    if constexpr (P == Precision::FP32) if (isa == Isa::SSE) return distSse<IP, DIM>;
+#endif
+    return distScalar<P, IP, DIM>;
+}
+
+template<size_t DIM>
+static hnswlib::DISTFUNC<float> kernelFor(Precision precision, Metric metric, Isa isa) {
+    bool ip = metric != Metric::L2;
+    switch (precision) {
+        case Precision::FP16: return ip ? kernelFor<Precision::FP16, true, DIM>(isa) : kernelFor<Precision::FP16, false, DIM>(isa);
+        case Precision::BF16: return ip ? kernelFor<Precision::BF16, true, DIM>(isa) : kernelFor<Precision::BF16, false, DIM>(isa);
+        default: return ip ? kernelFor<Precision::FP32, true, DIM>(isa) : kernelFor<Precision::FP32, false, DIM>(isa);
+    }
+}
+
+// Dimensions with fully unrolled kernel instantiations; any other dim uses the runtime-dim kernels
+template<size_t... Dims>
+struct DimRegistry {
+    static bool specialized(size_t dim) { return ((dim == Dims) || ...); }
+    static hnswlib::DISTFUNC<float> lookup(size_t dim, Precision precision, Metric metric, Isa isa) {
+        hnswlib::DISTFUNC<float> f = nullptr;
+        ((dim == Dims && (f = kernelFor<Dims>(precision, metric, isa))) || ...);
+        return f ? f : kernelFor<0>(precision, metric, isa);
+    }
+    static BatchDistFunc lookupBatch(size_t dim, Precision precision, Metric metric, Isa isa) {
+        BatchDistFunc f = nullptr;
+        ((dim == Dims && (f = batchKernelFor<Dims>(precision, metric, isa))) || ...);
+        return f ? f : batchKernelFor<0>(precision, metric, isa);
+    }
 };
+using KernelRegistry = DimRegistry<128, 256, 384, 512, 768, 1024, 1536, 3072>;
 
-struct Table {
-    unordered_map<string,Record> records;
-    unique_ptr<hnswlib::HierarchicalNSW<float>> index;
-    unordered_map<size_t,string> labelToID;
-    size_t nextLabel = 0;
-    int dim = 0;
+static const hnswlib::DISTFUNC<float> l2Kernel = kernelFor<0>(Precision::FP32, Metric::L2, cpuIsa);
+static const hnswlib::DISTFUNC<float> ipKernel = kernelFor<0>(Precision::FP32, Metric::IP, cpuIsa);
+
+static inline float l2Distance(const float *a, const float *b, size_t dim) { return l2Kernel(a, b, &dim); }
+static inline float dotProduct(const float *a, const float *b, size_t dim) { return 1.0f - ipKernel(a, b, &dim); }
+
+static void normalize(vector<float> &v) {
+    float norm = sqrt(dotProduct(v.data(), v.data(), v.size()));
+    if (norm > 0) for (auto &x : v) x /= norm;
+}
 
-    // Structured field index: fieldName -> fieldValue -> set(recordIDs)
-    unordered_map<string, unordered_map<string, unordered_set<string>>> fieldIndex;
+// hnswlib space owned by MidDB: metric x storage precision, with the kernel picked for the
+// running CPU and, for registered dimensions, the fixed-dimension instantiation
+class VectorSpace : public hnswlib::SpaceInterface<float> {
+    hnswlib::DISTFUNC<float> fstdistfunc_;
+    BatchDistFunc batch_;
+    size_t dim_, elemSize_;
+
+public:
+    VectorSpace(size_t dim, Metric metric, Precision precision)
+        : fstdistfunc_(KernelRegistry::lookup(dim, precision, metric, cpuIsa)),
+          batch_(KernelRegistry::lookupBatch(dim, precision, metric, cpuIsa)), dim_(dim),
+          elemSize_(precision == Precision::FP32 ? sizeof(float) : sizeof(uint16_t)) {}
+    size_t get_data_size() override { return dim_ * elemSize_; }
+    hnswlib::DISTFUNC<float> get_dist_func() override { return fstdistfunc_; }
+    void *get_dist_func_param() override { return &dim_; }
+
+    // out[j] = distance(query, xs[j]) for j < n, four vectors per kernel call where available
+    void distances(const void *query, const void *const *xs, size_t n, float *out) const {
+        size_t j = 0;
+        if (batch_) for (; j + 4 <= n; j += 4) batch_(query, xs + j, out + j, dim_);
+        for (; j < n; j++) out[j] = fstdistfunc_(query, xs[j], &dim_);
+    }
+    string kernelName() const {
+        return string(isaName(cpuIsa)) + (KernelRegistry::specialized(dim_) ? "/dim" + to_string(dim_) : "/generic");
+    }
 };
 
-// --- MidDB Class ---
-class MidDB {
-private:
-    unordered_map<string,Table> tables;
-    string storageDir = "data";
-    mutable shared_mutex dbMutex; // for shared read access
+// Splits [0,n) into contiguous ranges, one per hardware thread
+static void parallelFor(size_t n, const function<void(size_t,size_t)> &fn) {
+    size_t workers = min<size_t>(max(1u, thread::hardware_concurrency()), max<size_t>(1, n));
+    size_t chunk = (n + workers - 1) / workers;
+    vector<thread> pool;
+    for (size_t begin = 0; begin < n; begin += chunk)
+        pool.emplace_back(fn, begin, min(n, begin + chunk));
+    for (auto &t : pool) t.join();
+}
 
-    // Async insert
-    struct InsertTask { string tableName, recordID; unordered_map<string,string> fields; vector<float> embedding; };
-    queue<InsertTask> insertQueue;
-    mutex queueMutex;               // only for queue + condition_variable
-    condition_variable cv;
-    bool stopWorker = false;
-    thread workerThread;
+// --- HNSW traversal ---
+// Search over hnswlib's public graph layout instead of searchKnn. Before any distance is
+// computed, the unvisited neighbors' vectors are prefetched. Their distances are then
+// evaluated four per kernel call. The next candidate's link list is prefetched while the
+// current one is scored.
+struct SearchParams {
+    size_t ef = 0;        // 0 = the index's ef
+    bool prefetch = true;
+    // Early termination (searchGraph only), 0 = unlimited
+    size_t maxDistances = 0;
+    double maxMicros = 0;
+    size_t patience = 0;  // stop after this many expansions without improving the top k
+    int64_t entry = -1;   // level-0 start node (internal id) instead of the upper-level descent
+};
 
-    string tableFile(const string &tableName) { return storageDir + "/" + tableName + ".json"; }
-    string indexFile(const string &tableName) { return storageDir + "/" + tableName + ".index"; }
+struct SearchStats {
+    size_t distances = 0;   // distance evaluations
+    size_t hops = 0;        // nodes whose neighbor list was expanded, all levels
+    size_t ef = 0;          // beam width the search ran with
+    size_t efAchieved = 0;  // results as final as an unbudgeted search with this ef would return
+    double micros = 0;
+    const char *stop = "converged"; // or "distances", "time", "patience", "groups"
+};
+
+// Explain output of one query: the plan taken, search effort and time per stage. Stages are
+// laps: each one covers the time since the previous stage ended.
+struct QueryProfile {
+    json plan, stages;      // object and array once filled
+    SearchStats search;
+    chrono::steady_clock::time_point started = chrono::steady_clock::now(), mark = started;
+
+    void stage(const string &name) {
+        auto now = chrono::steady_clock::now();
+        stages.push_back({{"stage", name}, {"micros", chrono::duration<double, micro>(now - mark).count()}});
+        mark = now;
+    }
+};
+
+static inline void prefetchBytes(const void *p, size_t bytes) {
+    auto c = static_cast<const char*>(p);
+    for (size_t off = 0; off < bytes; off += 64) __builtin_prefetch(c + off);
+}
+
+using HnswIndex = hnswlib::HierarchicalNSW<float>;
+
+// Greedy descent through the upper levels; returns the level-0 entry node and its distance
+static pair<hnswlib::tableint,float> greedyDescent(const HnswIndex &index, const VectorSpace &space,
+                                                   const void *query, bool prefetch, SearchStats &st) {
+    using hnswlib::tableint;
+    tableint cur = index.enterpoint_node_;
+    const void *data = index.getDataByInternalId(cur);
+    float curDist;
+    space.distances(query, &data, 1, &curDist);
+    st.distances++;
+    vector<const void*> ptrs;
+    vector<float> dists;
+    for (int level = index.maxlevel_; level > 0; level--) {
+        for (bool changed = true; changed;) {
+            changed = false;
+            st.hops++;
+            auto list = index.get_linklist(cur, level);
+            size_t n = index.getListCount(list);
+            auto ids = reinterpret_cast<const tableint*>(list + 1);
+            ptrs.resize(n);
+            dists.resize(n);
+            for (size_t j = 0; j < n; j++) {
+                ptrs[j] = index.getDataByInternalId(ids[j]);
+                if (prefetch) prefetchBytes(ptrs[j], index.data_size_);
+            }
+            space.distances(query, ptrs.data(), n, dists.data());
+            st.distances += n;
+            for (size_t j = 0; j < n; j++)
+                if (dists[j] < curDist) { curDist = dists[j]; cur = ids[j]; changed = true; }
+        }
+    }
+    return {cur, curDist};
+}
+
+// Level-0 beam of one query: nearest-first frontier plus the ef best accepted nodes
+struct GraphBeam {
+    using Entry = pair<float,hnswlib::tableint>;
+    priority_queue<Entry> top;                                     // furthest result on top
+    priority_queue<Entry, vector<Entry>, greater<Entry>> frontier; // nearest candidate on top
+    float bound = numeric_limits<float>::max();
+    size_t ef;
+
+    explicit GraphBeam(size_t ef) : ef(ef) {}
+
+    bool exhausted() const { return frontier.empty() || (frontier.top().first > bound && top.size() >= ef); }
+
+    // True if the node entered the results
+    bool offer(float dist, hnswlib::tableint id, bool accepted) {
+        if (top.size() >= ef && dist >= bound) return false;
+        frontier.emplace(dist, id);
+        if (accepted) {
+            top.emplace(dist, id);
+            if (top.size() > ef) top.pop();
+        }
+        if (!top.empty()) bound = top.top().first;
+        return accepted;
+    }
+
+    // Results closer than every unexpanded candidate; no further expansion can displace them
+    size_t settled() const {
+        if (exhausted()) return top.size();
+        size_t count = 0;
+        auto rest = top;
+        for (; !rest.empty(); rest.pop()) count += rest.top().first <= frontier.top().first;
+        return count;
+    }
+
+    // (distance, label) pairs, nearest first
+    vector<pair<float,size_t>> results(const HnswIndex &index, size_t k) {
+        while (top.size() > k) top.pop();
+        vector<pair<float,size_t>> out(top.size());
+        for (size_t i = out.size(); i-- > 0; top.pop())
+            out[i] = {top.top().first, index.getExternalLabel(top.top().second)};
+        return out;
+    }
+};
+
+static bool acceptNode(const HnswIndex &index, hnswlib::tableint id, hnswlib::BaseFilterFunctor *filter) {
+    return !index.isMarkedDeleted(id) && (!filter || (*filter)(index.getExternalLabel(id)));
+}
+
+// Grouped search: the perGroup nearest labels of each group key. Inside searchGraph a node
+// only enters the beam if it enters its group, so one large group cannot crowd the others
+// out of the beam.
+struct GroupedResults {
+    using Heap = priority_queue<pair<float,size_t>>; // furthest member on top
+    struct Group { Heap members; float best = numeric_limits<float>::max(); };
+
+    function<long(size_t)> groupOf; // group key of a label, -1 = ungrouped (skipped)
+    size_t groups, perGroup;
+    unordered_map<long,Group> byKey;
+    size_t full = 0;
+    float bound = numeric_limits<float>::max();
+    bool dirty = true;
+
+    GroupedResults(function<long(size_t)> groupOf, size_t groups, size_t perGroup)
+        : groupOf(std::move(groupOf)), groups(groups), perGroup(perGroup) {}
+
+    bool admit(float dist, size_t label) {
+        long key = groupOf(label);
+        if (key < 0) return false;
+        auto &g = byKey[key];
+        if (g.members.size() >= perGroup && dist >= g.members.top().first) return false;
+        g.members.emplace(dist, label);
+        if (g.members.size() > perGroup) g.members.pop();
+        else if (g.members.size() == perGroup) full++;
+        g.best = min(g.best, dist);
+        dirty = true;
+        return true;
+    }
+
+    // True once the `groups` best groups are full and their furthest member is closer than
+    // the nearest unexpanded candidate
+    bool complete(float nearestCandidate) {
+        if (full < groups) return false;
+        if (dirty) {
+            vector<pair<float,const Group*>> ranked;
+            for (auto &[key, g] : byKey) ranked.push_back({g.best, &g});
+            nth_element(ranked.begin(), ranked.begin() + (groups - 1), ranked.end());
+            bound = 0;
+            for (size_t i = 0; i < groups; i++) {
+                auto &members = ranked[i].second->members;
+                bound = max(bound, members.size() < perGroup ? numeric_limits<float>::max() : members.top().first);
+            }
+            dirty = false;
+        }
+        return nearestCandidate > bound;
+    }
+
+    // (key, members nearest first) for the `groups` groups with the nearest best member
+    vector<pair<long,vector<pair<float,size_t>>>> ranked() const {
+        vector<pair<long,vector<pair<float,size_t>>>> out;
+        for (auto &[key, g] : byKey) {
+            vector<pair<float,size_t>> members;
+            for (auto heap = g.members; !heap.empty(); heap.pop()) members.push_back(heap.top());
+            reverse(members.begin(), members.end());
+            out.push_back({key, std::move(members)});
+        }
+        sort(out.begin(), out.end(), [](auto &a, auto &b) { return a.second.front() < b.second.front(); });
+        if (out.size() > groups) out.resize(groups);
+        return out;
+    }
+};
+
+// Returns (distance, label) pairs, nearest first
+static vector<pair<float,size_t>> searchGraph(const HnswIndex &index, const VectorSpace &space,
+                                              const void *query, size_t k, const SearchParams &params = {},
+                                              hnswlib::BaseFilterFunctor *filter = nullptr, SearchStats *stats = nullptr,
+                                              GroupedResults *grouped = nullptr) {
+    using hnswlib::tableint;
+    if (index.cur_element_count == 0 || index.enterpoint_node_ == (tableint)-1) return {};
+    auto accept = [&](tableint id, float dist) {
+        return acceptNode(index, id, filter) && (!grouped || grouped->admit(dist, index.getExternalLabel(id)));
+    };
+    SearchStats local;
+    SearchStats &st = stats ? *stats : local;
+    auto start = chrono::steady_clock::now();
+    auto micros = [&] { return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count(); };
+    auto [cur, curDist] = params.entry >= 0 ? pair<tableint,float>{(tableint)params.entry, 0.0f}
+                                            : greedyDescent(index, space, query, params.prefetch, st);
+    if (params.entry >= 0) {
+        const void *data = index.getDataByInternalId(cur);
+        space.distances(query, &data, 1, &curDist);
+        st.distances++;
+    }
+
+    // Best-first search on level 0 with a beam of ef
+    GraphBeam beam(max(params.ef ? params.ef : index.ef_, k));
+    st.ef = beam.ef;
+    priority_queue<float> bestK; // k nearest accepted distances, for patience
+    size_t stalled = 0;
+    auto visited = index.visited_list_pool_->getFreeVisitedList();
+    hnswlib::vl_type *mass = visited->mass, tag = visited->curV;
+    if (beam.offer(curDist, cur, accept(cur, curDist))) bestK.push(curDist);
+    mass[cur] = tag;
+
+    vector<tableint> fresh;
+    vector<const void*> ptrs;
+    vector<float> dists;
+    while (!beam.exhausted()) {
+        if (params.maxDistances && st.distances >= params.maxDistances) { st.stop = "distances"; break; }
+        if (params.maxMicros && micros() >= params.maxMicros) { st.stop = "time"; break; }
+        if (params.patience && stalled >= params.patience) { st.stop = "patience"; break; }
+        if (grouped && grouped->complete(beam.frontier.top().first)) { st.stop = "groups"; break; }
+        tableint id = beam.frontier.top().second;
+        beam.frontier.pop();
+        st.hops++;
+        auto list = index.get_linklist0(id);
+        size_t n = index.getListCount(list);
+        auto ids = reinterpret_cast<const tableint*>(list + 1);
+        if (params.prefetch)
+            for (size_t j = 0; j < n; j++) __builtin_prefetch(mass + ids[j]);
+        fresh.clear();
+        ptrs.clear();
+        for (size_t j = 0; j < n; j++) {
+            if (mass[ids[j]] == tag) continue;
+            mass[ids[j]] = tag;
+            fresh.push_back(ids[j]);
+            ptrs.push_back(index.getDataByInternalId(ids[j]));
+            if (params.prefetch) prefetchBytes(ptrs.back(), index.data_size_);
+        }
+        if (params.maxDistances && st.distances + fresh.size() > params.maxDistances) {
+            // Last expansion: score only what the budget allows, leave the rest unvisited
+            size_t keep = params.maxDistances > st.distances ? params.maxDistances - st.distances : 0;
+            for (size_t j = keep; j < fresh.size(); j++) mass[fresh[j]] = 0;
+            fresh.resize(keep);
+            ptrs.resize(keep);
+        }
+        dists.resize(fresh.size());
+        space.distances(query, ptrs.data(), fresh.size(), dists.data());
+        st.distances += fresh.size();
+        bool improved = false;
+        for (size_t j = 0; j < fresh.size(); j++) {
+            if (!beam.offer(dists[j], fresh[j], accept(fresh[j], dists[j]))) continue;
+            if (bestK.size() < k || dists[j] < bestK.top()) {
+                bestK.push(dists[j]);
+                if (bestK.size() > k) bestK.pop();
+                improved = true;
+            }
+        }
+        stalled = improved ? 0 : stalled + 1;
+        if (params.prefetch && !beam.frontier.empty())
+            prefetchBytes(index.get_linklist0(beam.frontier.top().second), index.size_links_level0_);
+    }
+    index.visited_list_pool_->releaseVisitedList(visited);
+    st.efAchieved = beam.settled();
+    st.micros = micros();
+    return beam.results(index, k);
+}
+
+// Renumbers internal node ids in BFS order from the entry point so nodes that are close in
+// the graph are close in memory. Labels stay as they are; level-0 blocks, upper-level link
+// lists, label_lookup_ and the entry point are rewritten to the new ids.
+static void reorderGraph(HnswIndex &index) {
+    using hnswlib::tableint;
+    using hnswlib::linklistsizeint;
+    const size_t n = index.cur_element_count;
+    if (n < 2) return;
+    const tableint unassigned = (tableint)-1;
+    vector<tableint> order, newId(n, unassigned);
+    order.reserve(n);
+    size_t head = 0;
+    auto bfs = [&](tableint start) {
+        if (newId[start] != unassigned) return;
+        newId[start] = order.size();
+        order.push_back(start);
+        for (; head < order.size(); head++) {
+            auto list = index.get_linklist0(order[head]);
+            auto ids = reinterpret_cast<tableint*>(list + 1);
+            for (size_t j = 0, count = index.getListCount(list); j < count; j++)
+                if (newId[ids[j]] == unassigned) { newId[ids[j]] = order.size(); order.push_back(ids[j]); }
+        }
+    };
+    bfs(index.enterpoint_node_);
+    for (tableint id = 0; id < n; id++) bfs(id); // nodes unreachable on level 0
+
+    auto remap = [&](linklistsizeint *list) {
+        auto ids = reinterpret_cast<tableint*>(list + 1);
+        for (size_t j = 0, count = index.getListCount(list); j < count; j++) ids[j] = newId[ids[j]];
+    };
+    const size_t block = index.size_data_per_element_;
+    char *level0 = static_cast<char*>(malloc(index.max_elements_ * block));
+    if (!level0) throw bad_alloc();
+    vector<char*> links(n);
+    vector<int> levels(n);
+    for (size_t p = 0; p < n; p++) {
+        tableint old = order[p];
+        memcpy(level0 + p * block, index.data_level0_memory_ + old * block, block);
+        remap(reinterpret_cast<linklistsizeint*>(level0 + p * block + index.offsetLevel0_));
+        links[p] = index.linkLists_[old];
+        levels[p] = index.element_levels_[old];
+        for (int level = 1; level <= levels[p]; level++)
+            remap(reinterpret_cast<linklistsizeint*>(links[p] + (level - 1) * index.size_links_per_element_));
+    }
+    free(index.data_level0_memory_);
+    index.data_level0_memory_ = level0;
+    copy(links.begin(), links.end(), index.linkLists_);
+    copy(levels.begin(), levels.end(), index.element_levels_.begin());
+    for (auto &[label, id] : index.label_lookup_) id = newId[id];
+    index.enterpoint_node_ = newId[index.enterpoint_node_];
+    unordered_set<tableint> deleted;
+    for (auto id : index.deleted_elements) deleted.insert(newId[id]);
+    index.deleted_elements.swap(deleted);
+}
+
+// --- Disk-resident graph index (Vamana + PQ) ---
+// Full vectors and adjacency lists live on disk in fixed-size node blocks; only the PQ
+// codes, codebook and labels stay in memory. Queries run a beam search ordered by PQ
+// distance and re-rank exactly with the vectors read from the visited node blocks.
+//
+// File layout: 4 KiB header | n node blocks [vector | degree | neighbors[R]] | labels | codebook | codes
+class DiskGraphIndex {
+public:
+    struct Params {
+        uint32_t R = 32;        // max out-degree
+        uint32_t L = 64;        // build candidate list size
+        float alpha = 1.2f;     // pruning slack of the second pass
+        uint32_t pqChunks = 0;  // PQ bytes per vector, 0 = dim/4 capped at 64
+    };
+
+    explicit DiskGraphIndex(const string &path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw runtime_error("cannot open disk index " + path);
+        Header h;
+        readAt(&h, sizeof(h), 0);
+        if (memcmp(h.magic, MAGIC, sizeof(h.magic)) != 0) throw runtime_error("not a MidDB disk index: " + path);
+        dim = h.dim; R = h.R; n = h.n; medoid = h.medoid; blockSize = h.blockSize;
+        pqChunks = h.pqChunks; pqCentroids = h.pqCentroids;
+        fullDistance = KernelRegistry::lookup(dim, Precision::FP32, Metric::L2, cpuIsa);
+        labels.resize(n);
+        codebook.resize((size_t)pqCentroids * dim);
+        codes.resize(n * pqChunks);
+        uint64_t off = HEADER_SIZE + n * blockSize;
+        readAt(labels.data(), n * sizeof(uint64_t), off);
+        off += n * sizeof(uint64_t);
+        readAt(codebook.data(), codebook.size() * sizeof(float), off);
+        off += codebook.size() * sizeof(float);
+        readAt(codes.data(), codes.size(), off);
+        for (size_t i = 0; i < n; i++) rows[labels[i]] = i;
+    }
+
+    ~DiskGraphIndex() { if (fd >= 0) ::close(fd); }
+
+    size_t size() const { return n; }
+    size_t dimension() const { return dim; }
+    size_t memoryBytes() const {
+        return labels.size() * sizeof(uint64_t) + rows.size() * (sizeof(uint64_t) + sizeof(uint32_t)) +
+               codebook.size() * sizeof(float) + codes.size();
+    }
+
+    bool contains(size_t label) const { return rows.count(label); }
+
+    // Full vector of a label, read from the front of its node block
+    vector<float> vectorOf(size_t label) const {
+        auto it = rows.find(label);
+        if (it == rows.end()) throw runtime_error("label " + to_string(label) + " is not in the disk index");
+        vector<float> v(dim);
+        readAt(v.data(), dim * sizeof(float), HEADER_SIZE + (uint64_t)it->second * blockSize);
+        return v;
+    }
+
+    // Nearest-first (distance, label) pairs; labels rejected by isAllowed are traversed but not returned
+    vector<pair<float,size_t>> search(const float *query, size_t k, size_t L = 64, size_t beamWidth = 4,
+                                      hnswlib::BaseFilterFunctor *isAllowed = nullptr) const {
+        vector<pair<float,size_t>> result;
+        if (n == 0) return result;
+        L = max(L, k);
+
+        // Asymmetric PQ lookup table: distance from each query chunk to every centroid
+        vector<float> lut((size_t)pqChunks * pqCentroids);
+        for (uint32_t c = 0; c < pqChunks; c++) {
+            size_t lo = chunkBegin(c), hi = chunkBegin(c + 1);
+            for (uint32_t j = 0; j < pqCentroids; j++)
+                lut[(size_t)c * pqCentroids + j] = l2Distance(query + lo, &codebook[(size_t)j * dim + lo], hi - lo);
+        }
+        auto pqDistance = [&](uint32_t id) {
+            const uint8_t *code = &codes[(size_t)id * pqChunks];
+            float sum = 0;
+            for (uint32_t c = 0; c < pqChunks; c++) sum += lut[(size_t)c * pqCentroids + code[c]];
+            return sum;
+        };
+
+        struct Candidate { float dist; uint32_t id; bool expanded; };
+        vector<Candidate> list{{pqDistance(medoid), medoid, false}};
+        unordered_set<uint32_t> seen{medoid};
+        vector<pair<float,uint32_t>> exact;
+        vector<uint32_t> beam;
+        vector<char> buf(beamWidth * blockSize);
 
-    void worker() {
-        vector<InsertTask> batch;
         while (true) {
-            {
-                unique_lock<mutex> lock(queueMutex);
-                cv.wait_for(lock, chrono::seconds(5), [&]{ return !insertQueue.empty() || stopWorker; });
-                if (stopWorker && insertQueue.empty()) break;
-                batch.clear();
-                while (!insertQueue.empty() && batch.size() < 100) {
-                    batch.push_back(insertQueue.front());
-                    insertQueue.pop();
+            beam.clear();
+            for (auto &c : list)
+                if (!c.expanded) { c.expanded = true; beam.push_back(c.id); if (beam.size() == beamWidth) break; }
+            if (beam.empty()) break;
+            readBlocks(beam, buf.data());
+            for (size_t b = 0; b < beam.size(); b++) {
+                const char *block = buf.data() + b * blockSize;
+                const float *vec = reinterpret_cast<const float*>(block);
+                uint32_t degree; memcpy(&degree, block + dim * sizeof(float), sizeof(degree));
+                const uint32_t *nbrs = reinterpret_cast<const uint32_t*>(block + dim * sizeof(float) + sizeof(uint32_t));
+                exact.emplace_back(fullDistance(query, vec, &dim), beam[b]);
+                for (uint32_t i = 0; i < min(degree, R); i++) {
+                    uint32_t nb = nbrs[i];
+                    if (!seen.insert(nb).second) continue;
+                    float d = pqDistance(nb);
+                    if (list.size() >= L && d >= list.back().dist) continue;
+                    auto pos = upper_bound(list.begin(), list.end(), d, [](float v, const Candidate &c){ return v < c.dist; });
+                    list.insert(pos, {d, nb, false});
+                    if (list.size() > L) list.pop_back();
                 }
             }
-            for (auto &task : batch) processInsert(task);
-            saveAllTables();
         }
+
+        sort(exact.begin(), exact.end());
+        for (auto &[d, id] : exact) {
+            if (isAllowed && !(*isAllowed)(labels[id])) continue;
+            result.emplace_back(d, labels[id]);
+            if (result.size() == k) break;
+        }
+        return result;
     }
 
-    void processInsert(const InsertTask &task) {
-        unique_lock<shared_mutex> lock(dbMutex);
+    // Builds the graph and codebook in memory from row-major vectors, then writes the index file
+    static void build(const string &path, const vector<float> &data, const vector<size_t> &rowLabels,
+                      size_t dim, const Params &params) {
+        size_t n = rowLabels.size();
+        if (n == 0 || dim == 0) throw runtime_error("nothing to index");
+        uint32_t R = max<uint32_t>(params.R, 2);
+        auto vec = [&](size_t i) { return &data[i * dim]; };
+        auto full = KernelRegistry::lookup(dim, Precision::FP32, Metric::L2, cpuIsa);
+        auto dist = [&](const float *a, const float *b) { return full(a, b, &dim); };
 
-        if (tables.find(task.tableName) == tables.end())
-            createTable(task.tableName, task.embedding.size());
+        // Medoid: point closest to the centroid
+        vector<float> mean(dim, 0.0f);
+        for (size_t i = 0; i < n; i++) for (size_t d = 0; d < dim; d++) mean[d] += vec(i)[d] / n;
+        uint32_t medoid = 0; float best = numeric_limits<float>::max();
+        for (size_t i = 0; i < n; i++) {
+            float d = dist(vec(i), mean.data());
+            if (d < best) { best = d; medoid = i; }
+        }
 
-        auto &table = tables[task.tableName];
-        if (!table.index) {
-            auto space = new hnswlib::L2Space(task.embedding.size());
-            table.index.reset(new hnswlib::HierarchicalNSW<float>(space, 20000));
+        // Random initial graph, then two Vamana passes (alpha = 1, then params.alpha)
+        vector<vector<uint32_t>> graph(n);
+        vector<mutex> locks(min<size_t>(n, 4096));
+        mt19937 rng(42);
+        for (size_t i = 0; i < n; i++) {
+            for (uint32_t j = 0; j < min<size_t>(R / 2, n - 1); j++) {
+                uint32_t nb = rng() % n;
+                if (nb != i) graph[i].push_back(nb);
+            }
+        }
+        auto neighbors = [&](uint32_t p) { lock_guard<mutex> g(locks[p % locks.size()]); return graph[p]; };
+        auto prune = [&](uint32_t p, vector<pair<float,uint32_t>> &cand, float alpha) {
+            sort(cand.begin(), cand.end());
+            cand.erase(unique(cand.begin(), cand.end(), [](auto &a, auto &b){ return a.second == b.second; }), cand.end());
+            vector<uint32_t> out;
+            vector<bool> dropped(cand.size(), false);
+            for (size_t i = 0; i < cand.size() && out.size() < R; i++) {
+                if (dropped[i] || cand[i].second == p) continue;
+                out.push_back(cand[i].second);
+                for (size_t j = i + 1; j < cand.size(); j++)
+                    if (!dropped[j] && alpha * dist(vec(cand[i].second), vec(cand[j].second)) <= cand[j].first)
+                        dropped[j] = true;
+            }
+            return out;
+        };
+        for (float alpha : {1.0f, max(1.0f, params.alpha)}) {
+            vector<uint32_t> order(n);
+            iota(order.begin(), order.end(), 0);
+            shuffle(order.begin(), order.end(), rng);
+            parallelFor(n, [&](size_t begin, size_t end) {
+                for (size_t o = begin; o < end; o++) {
+                    uint32_t p = order[o];
+                    auto visited = greedyVisit(vec(p), medoid, max<uint32_t>(params.L, R), dim, data, neighbors, dist);
+                    for (auto nb : neighbors(p)) visited.emplace_back(dist(vec(p), vec(nb)), nb);
+                    auto pruned = prune(p, visited, alpha);
+                    { lock_guard<mutex> g(locks[p % locks.size()]); graph[p] = pruned; }
+                    for (auto nb : pruned) {
+                        lock_guard<mutex> g(locks[nb % locks.size()]);
+                        auto &adj = graph[nb];
+                        if (find(adj.begin(), adj.end(), p) != adj.end()) continue;
+                        if (adj.size() < R) { adj.push_back(p); continue; }
+                        vector<pair<float,uint32_t>> cand;
+                        for (auto x : adj) cand.emplace_back(dist(vec(nb), vec(x)), x);
+                        cand.emplace_back(dist(vec(nb), vec(p)), p);
+                        adj = prune(nb, cand, alpha);
+                    }
+                }
+            });
         }
 
-        size_t label;
-        auto recIt = table.records.find(task.recordID);
-        if (recIt != table.records.end()) {
-            // Update existing record (preserve label)
-            label = recIt->second.label;
-            recIt->second.fields = task.fields;
-            recIt->second.embedding = task.embedding;
-        } else {
-            // Insert new record
-            label = table.nextLabel++;
-            table.records[task.recordID] = {task.fields, task.embedding, label};
+        // Product quantization: k-means per chunk over a sample
+        uint32_t chunks = params.pqChunks ? params.pqChunks : (uint32_t)min<size_t>(64, max<size_t>(1, dim / 4));
+        chunks = min<uint32_t>(chunks, dim);
+        uint32_t centroids = min<size_t>(256, n);
+        vector<float> codebook((size_t)centroids * dim);
+        vector<size_t> sample(n);
+        iota(sample.begin(), sample.end(), 0);
+        shuffle(sample.begin(), sample.end(), rng);
+        sample.resize(min<size_t>(n, 100 * centroids));
+        auto chunkBegin = [&](uint32_t c) { return (size_t)c * dim / chunks; };
+        parallelFor(chunks, [&](size_t cb, size_t ce) {
+            for (size_t c = cb; c < ce; c++) {
+                size_t lo = chunkBegin(c), hi = chunkBegin(c + 1), w = hi - lo;
+                for (uint32_t j = 0; j < centroids; j++)
+                    copy_n(vec(sample[j % sample.size()]) + lo, w, &codebook[(size_t)j * dim + lo]);
+                vector<uint32_t> assign(sample.size());
+                for (int iter = 0; iter < 10; iter++) {
+                    for (size_t s = 0; s < sample.size(); s++) {
+                        float bd = numeric_limits<float>::max();
+                        for (uint32_t j = 0; j < centroids; j++) {
+                            float d = l2Distance(vec(sample[s]) + lo, &codebook[(size_t)j * dim + lo], w);
+                            if (d < bd) { bd = d; assign[s] = j; }
+                        }
+                    }
+                    vector<double> sums((size_t)centroids * w, 0.0);
+                    vector<size_t> counts(centroids, 0);
+                    for (size_t s = 0; s < sample.size(); s++) {
+                        counts[assign[s]]++;
+                        for (size_t d = 0; d < w; d++) sums[(size_t)assign[s] * w + d] += vec(sample[s])[lo + d];
+                    }
+                    for (uint32_t j = 0; j < centroids; j++)
+                        if (counts[j]) for (size_t d = 0; d < w; d++) codebook[(size_t)j * dim + lo + d] = sums[(size_t)j * w + d] / counts[j];
+                }
+            }
+        });
+        vector<uint8_t> codes(n * chunks);
+        parallelFor(n, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+                for (uint32_t c = 0; c < chunks; c++) {
+                    size_t lo = chunkBegin(c), w = chunkBegin(c + 1) - lo;
+                    float bd = numeric_limits<float>::max();
+                    for (uint32_t j = 0; j < centroids; j++) {
+                        float d = l2Distance(vec(i) + lo, &codebook[(size_t)j * dim + lo], w);
+                        if (d < bd) { bd = d; codes[i * chunks + c] = j; }
+                    }
+                }
+        });
+
+        // Write header, node blocks and in-memory sections; rename into place when complete
+        Header h;
+        memcpy(h.magic, MAGIC, sizeof(h.magic));
+        h.dim = dim; h.R = R; h.n = n; h.medoid = medoid;
+        h.blockSize = roundUp(dim * sizeof(float) + sizeof(uint32_t) + R * sizeof(uint32_t), 512);
+        h.pqChunks = chunks; h.pqCentroids = centroids;
+        string tmp = path + ".tmp";
+        {
+            ofstream out(tmp, ios::binary | ios::trunc);
+            vector<char> page(HEADER_SIZE, 0);
+            memcpy(page.data(), &h, sizeof(h));
+            out.write(page.data(), page.size());
+            vector<char> block(h.blockSize);
+            for (size_t i = 0; i < n; i++) {
+                fill(block.begin(), block.end(), 0);
+                memcpy(block.data(), vec(i), dim * sizeof(float));
+                uint32_t degree = graph[i].size();
+                memcpy(block.data() + dim * sizeof(float), &degree, sizeof(degree));
+                memcpy(block.data() + dim * sizeof(float) + sizeof(degree), graph[i].data(), degree * sizeof(uint32_t));
+                out.write(block.data(), block.size());
+            }
+            vector<uint64_t> labels(rowLabels.begin(), rowLabels.end());
+            out.write(reinterpret_cast<const char*>(labels.data()), labels.size() * sizeof(uint64_t));
+            out.write(reinterpret_cast<const char*>(codebook.data()), codebook.size() * sizeof(float));
+            out.write(reinterpret_cast<const char*>(codes.data()), codes.size());
+            if (!out) throw runtime_error("failed writing " + tmp);
+        }
+        fs::rename(tmp, path);
+    }
+
+private:
+    static constexpr char MAGIC[8] = {'M','D','B','D','I','S','K','1'};
+    static constexpr size_t HEADER_SIZE = 4096;
+    struct Header { char magic[8]; uint32_t dim, R; uint64_t n; uint32_t medoid, blockSize, pqChunks, pqCentroids; };
+
+    int fd = -1;
+    hnswlib::DISTFUNC<float> fullDistance = nullptr;
+    size_t dim = 0, n = 0, blockSize = 0;
+    uint32_t R = 0, medoid = 0, pqChunks = 0, pqCentroids = 0;
+    vector<uint64_t> labels;
+    unordered_map<uint64_t,uint32_t> rows; // label -> node block
+    vector<float> codebook;
+    vector<uint8_t> codes;
+
+    static size_t roundUp(size_t v, size_t to) { return (v + to - 1) / to * to; }
+    size_t chunkBegin(uint32_t c) const { return (size_t)c * dim / pqChunks; }
+
+    void readAt(void *dst, size_t len, uint64_t off) const {
+        char *p = static_cast<char*>(dst);
+        while (len > 0) {
+            ssize_t r = ::pread(fd, p, len, off);
+            if (r <= 0) throw runtime_error("disk index read failed");
+            p += r; len -= r; off += r;
+        }
+    }
+
+    // Reads the node blocks of one beam; one io_uring submission when built with MIDDB_IO_URING
+    void readBlocks(const vector<uint32_t> &ids, char *buf) const {
+#ifdef MIDDB_IO_URING
+        struct Ring {
+            io_uring ring; bool ok;
+            Ring() { ok = io_uring_queue_init(64, &ring, 0) == 0; }
+            ~Ring() { if (ok) io_uring_queue_exit(&ring); }
+        };
+        thread_local Ring r;
+        if (r.ok && ids.size() <= 64) {
+            for (size_t i = 0; i < ids.size(); i++) {
+                io_uring_sqe *sqe = io_uring_get_sqe(&r.ring);
+                io_uring_prep_read(sqe, fd, buf + i * blockSize, blockSize, HEADER_SIZE + (uint64_t)ids[i] * blockSize);
+            }
+            io_uring_submit_and_wait(&r.ring, ids.size());
+            bool shortRead = false;
+            for (size_t i = 0; i < ids.size(); i++) {
+                io_uring_cqe *cqe;
+                io_uring_wait_cqe(&r.ring, &cqe);
+                if (cqe->res != (int)blockSize) shortRead = true;
+                io_uring_cqe_seen(&r.ring, cqe);
+            }
+            if (!shortRead) return;
+        }
+#endif
+        for (size_t i = 0; i < ids.size(); i++)
+            readAt(buf + i * blockSize, blockSize, HEADER_SIZE + (uint64_t)ids[i] * blockSize);
+    }
+
+    // Greedy search over the in-memory build graph; returns every expanded node with its distance
+    template<typename Neighbors, typename Distance>
+    static vector<pair<float,uint32_t>> greedyVisit(const float *q, uint32_t start, size_t L, size_t dim,
+                                                    const vector<float> &data, Neighbors &neighbors, Distance &dist) {
+        struct Candidate { float dist; uint32_t id; bool expanded; };
+        vector<Candidate> list{{dist(q, &data[(size_t)start * dim]), start, false}};
+        unordered_set<uint32_t> seen{start};
+        vector<pair<float,uint32_t>> visited;
+        while (true) {
+            auto it = find_if(list.begin(), list.end(), [](auto &c){ return !c.expanded; });
+            if (it == list.end()) break;
+            it->expanded = true;
+            uint32_t cur = it->id;
+            visited.emplace_back(it->dist, cur);
+            for (auto nb : neighbors(cur)) {
+                if (!seen.insert(nb).second) continue;
+                float d = dist(q, &data[(size_t)nb * dim]);
+                if (list.size() >= L && d >= list.back().dist) continue;
+                auto pos = upper_bound(list.begin(), list.end(), d, [](float v, const Candidate &c){ return v < c.dist; });
+                list.insert(pos, {d, nb, false});
+                if (list.size() > L) list.pop_back();
+            }
+        }
+        return visited;
+    }
+};
+
+// --- Binary quantization ---
+using HammingFunc = uint32_t(*)(const uint64_t*, const uint64_t*, size_t);
+
+static uint32_t hammingScalar(const uint64_t *a, const uint64_t *b, size_t words) {
+    uint32_t d = 0;
+    for (size_t i = 0; i < words; i++) d += __builtin_popcountll(a[i] ^ b[i]);
+    return d;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("popcnt")))
+static uint32_t hammingPopcnt(const uint64_t *a, const uint64_t *b, size_t words) {
+    uint32_t d = 0;
+    for (size_t i = 0; i < words; i++) d += __builtin_popcountll(a[i] ^ b[i]);
+    return d;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static uint32_t hammingAvx512(const uint64_t *a, const uint64_t *b, size_t words) {
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 8 <= words; i += 8)
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i))));
+    uint64_t lanes[8];
+    _mm512_storeu_si512(lanes, acc);
+    _mm256_zeroupper();
+    uint32_t d = 0;
+    for (uint64_t lane : lanes) d += lane;
+    for (; i < words; i++) d += __builtin_popcountll(a[i] ^ b[i]);
+    return d;
+}
+#endif
+
+static HammingFunc pickHamming() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (cpuIsa == Isa::AVX512 && __builtin_cpu_supports("avx512vpopcntdq")) return hammingAvx512;
+    if (cpuIsa != Isa::Scalar && __builtin_cpu_supports("popcnt")) return hammingPopcnt;
+#endif
+    return hammingScalar;
+}
+static const HammingFunc hammingDistance = pickHamming();
+
+// One sign bit per dimension, stored contiguously for a linear Hamming scan
+struct BinaryCodes {
+    size_t words = 0;
+    vector<uint64_t> codes;              // slot-major
+    vector<size_t> labels;               // slot -> label
+    unordered_map<size_t,size_t> slots;  // label -> slot
+
+    static vector<uint64_t> encode(const vector<float> &embedding) {
+        vector<uint64_t> code((embedding.size() + 63) / 64, 0);
+        for (size_t i = 0; i < embedding.size(); i++)
+            if (embedding[i] > 0) code[i / 64] |= 1ull << (i % 64);
+        return code;
+    }
+
+    void add(size_t label, const vector<float> &embedding) {
+        auto code = encode(embedding);
+        words = code.size();
+        auto it = slots.find(label);
+        size_t slot = it != slots.end() ? it->second : labels.size();
+        if (slot == labels.size()) {
+            slots[label] = slot;
+            labels.push_back(label);
+            codes.resize(codes.size() + words);
+        }
+        copy(code.begin(), code.end(), codes.begin() + slot * words);
+    }
+
+    void remove(size_t label) {
+        auto it = slots.find(label);
+        if (it == slots.end()) return;
+        size_t slot = it->second, last = labels.size() - 1;
+        slots.erase(it);
+        if (slot != last) {
+            copy_n(codes.begin() + last * words, words, codes.begin() + slot * words);
+            labels[slot] = labels[last];
+            slots[labels[slot]] = slot;
+        }
+        labels.pop_back();
+        codes.resize(last * words);
+    }
+
+    void clear() { codes.clear(); labels.clear(); slots.clear(); }
+
+    // (hamming, label) of the n closest codes, nearest first
+    vector<pair<uint32_t,size_t>> nearest(const vector<float> &query, size_t n) const {
+        vector<pair<uint32_t,size_t>> out;
+        if (labels.empty() || n == 0) return out;
+        auto q = encode(query);
+        priority_queue<pair<uint32_t,size_t>> heap;
+        for (size_t s = 0; s < labels.size(); s++) {
+            uint32_t d = hammingDistance(q.data(), &codes[s * words], words);
+            if (heap.size() < n) heap.emplace(d, labels[s]);
+            else if (d < heap.top().first) { heap.pop(); heap.emplace(d, labels[s]); }
+        }
+        out.resize(heap.size());
+        for (size_t i = out.size(); i-- > 0; heap.pop()) out[i] = heap.top();
+        return out;
+    }
+};
+
+// Typed, directed edges between records of a table. Adjacency arrays are indexed by record
+// label in both directions and edge types are interned to dense ids.
+struct EdgeIndex {
+    struct Edge { uint32_t node, type; };
+    vector<vector<Edge>> out, in;
+    vector<string> typeNames;
+    unordered_map<string,uint32_t> types;
+    size_t count = 0;
+
+    uint32_t typeId(const string &name) {
+        auto [it, inserted] = types.emplace(name, (uint32_t)typeNames.size());
+        if (inserted) typeNames.push_back(name);
+        return it->second;
+    }
+
+    bool add(size_t from, size_t to, uint32_t type) {
+        if (max(from, to) > numeric_limits<uint32_t>::max()) throw runtime_error("record label out of edge range");
+        if (max(from, to) >= out.size()) { out.resize(max(from, to) + 1); in.resize(out.size()); }
+        for (auto &e : out[from]) if (e.node == to && e.type == type) return false;
+        out[from].push_back({(uint32_t)to, type});
+        in[to].push_back({(uint32_t)from, type});
+        count++;
+        return true;
+    }
+
+    static void erase(vector<Edge> &list, size_t node, uint32_t type) {
+        list.erase(remove_if(list.begin(), list.end(), [&](const Edge &e) { return e.node == node && e.type == type; }), list.end());
+    }
+
+    bool remove(size_t from, size_t to, uint32_t type) {
+        if (from >= out.size() || to >= in.size()) return false;
+        size_t before = out[from].size();
+        erase(out[from], to, type);
+        if (out[from].size() == before) return false;
+        erase(in[to], from, type);
+        count--;
+        return true;
+    }
+
+    // Drops every edge touching a deleted record
+    void removeNode(size_t label) {
+        if (label >= out.size()) return;
+        for (auto &e : out[label]) { erase(in[e.node], label, e.type); count--; }
+        for (auto &e : in[label]) { erase(out[e.node], label, e.type); count--; }
+        out[label].clear();
+        in[label].clear();
+    }
+
+    const vector<Edge> &edges(size_t label, bool incoming) const {
+        static const vector<Edge> none;
+        auto &lists = incoming ? in : out;
+        return label < lists.size() ? lists[label] : none;
+    }
+};
+
+enum class DedupPolicy { Off, Reject, Merge }; // merge: new fields are copied onto the existing record
+
+// Per-table settings, persisted as data/<tableName>.meta
+struct TableConfig {
+    bool binaryQuantization = false;
+    Precision precision = Precision::FP32; // storage of Record embeddings, HNSW data and snapshots
+    Metric metric = Metric::L2;
+    size_t ef = 0;             // HNSW beam width for queries without "ef", 0 = index default
+    // ef auto-tuning: smallest ef reaching recallTarget (recall@recallK), 0 = off
+    double recallTarget = 0;
+    int recallK = 10;
+    size_t efTunedRecords = 0; // default-namespace records at the last tuning run
+    double efRecall = 0;       // recall measured for ef at that run
+    // New records within dedupDistance (table metric) of an existing one in their namespace
+    DedupPolicy dedup = DedupPolicy::Off;
+    double dedupDistance = 0;
+    size_t keepVersions = 0;   // superseded versions kept per record
+};
+
+static const char *precisionName(Precision p) {
+    return p == Precision::FP16 ? "fp16" : p == Precision::BF16 ? "bf16" : "fp32";
+}
+
+static const char *metricName(Metric m) {
+    return m == Metric::IP ? "ip" : m == Metric::Cosine ? "cosine" : "l2";
+}
+
+static const char *dedupName(DedupPolicy d) {
+    return d == DedupPolicy::Reject ? "reject" : d == DedupPolicy::Merge ? "merge" : "off";
+}
+
+void to_json(json &j, const TableConfig &c) {
+    j = {{"binaryQuantization", c.binaryQuantization}, {"precision", precisionName(c.precision)},
+         {"metric", metricName(c.metric)}, {"ef", c.ef}, {"recallTarget", c.recallTarget},
+         {"recallK", c.recallK}, {"efTunedRecords", c.efTunedRecords}, {"efRecall", c.efRecall},
+         {"dedup", dedupName(c.dedup)}, {"dedupDistance", c.dedupDistance}, {"keepVersions", c.keepVersions}};
+}
+
+void from_json(const json &j, TableConfig &c) {
+    c.binaryQuantization = j.value("binaryQuantization", c.binaryQuantization);
+    string precision = j.value("precision", string(precisionName(c.precision)));
+    if (precision == "fp32") c.precision = Precision::FP32;
+    else if (precision == "fp16") c.precision = Precision::FP16;
+    else if (precision == "bf16") c.precision = Precision::BF16;
+    else throw runtime_error("unknown precision " + precision);
+    string metric = j.value("metric", string(metricName(c.metric)));
+    if (metric == "l2") c.metric = Metric::L2;
+    else if (metric == "ip") c.metric = Metric::IP;
+    else if (metric == "cosine") c.metric = Metric::Cosine;
+    else throw runtime_error("unknown metric " + metric);
+    c.ef = j.value("ef", c.ef);
+    c.recallTarget = j.value("recallTarget", c.recallTarget);
+    c.recallK = j.value("recallK", c.recallK);
+    c.efTunedRecords = j.value("efTunedRecords", c.efTunedRecords);
+    c.efRecall = j.value("efRecall", c.efRecall);
+    if (c.recallTarget < 0 || c.recallTarget > 1) throw runtime_error("recallTarget must be in [0, 1]");
+    if (c.recallK < 1) throw runtime_error("recallK must be positive");
+    string dedup = j.value("dedup", string(dedupName(c.dedup)));
+    if (dedup == "off") c.dedup = DedupPolicy::Off;
+    else if (dedup == "reject") c.dedup = DedupPolicy::Reject;
+    else if (dedup == "merge") c.dedup = DedupPolicy::Merge;
+    else throw runtime_error("unknown dedup policy " + dedup);
+    c.dedupDistance = j.value("dedupDistance", c.dedupDistance);
+    if (c.dedupDistance < 0) throw runtime_error("dedupDistance must not be negative");
+    c.keepVersions = j.value("keepVersions", c.keepVersions);
+}
+
+static unique_ptr<hnswlib::SpaceInterface<float>> makeSpace(const TableConfig &config, size_t dim) {
+    return make_unique<VectorSpace>(dim, config.metric, config.precision);
+}
+
+// Per-request search knobs shared by the query endpoints
+struct QueryOptions {
+    string ns;              // namespace, "" = table default
+    string mode = "hnsw";   // "hnsw" or "binary" (Hamming scan + exact re-rank)
+    int oversample = 4;     // binary mode: candidates re-ranked per requested result
+    SearchParams search;    // HNSW beam width and early-termination budget
+    float mmrLambda = 1;    // < 1: maximal marginal relevance re-ranking, 0 = diversity only
+    int fetchK = 0;         // MMR candidate pool, 0 = 4 * topK
+    QueryProfile *profile = nullptr; // explain: filled in along the query path
+};
+
+// One record mutation of a write task
+struct WriteOp {
+    // Patch: merge fields into an existing record; AddEdge/RemoveEdge: edge recordID -edgeType-> target
+    enum Kind { Upsert, Delete, Patch, AddEdge, RemoveEdge } kind = Upsert;
+    string tableName, recordID;
+    unordered_map<string,string> fields;
+    vector<float> embedding;
+    string ns; // namespace, "" = table default
+    int64_t ifVersion = -1;   // apply only if the record is at this version
+    bool ifAbsent = false;    // apply only if the record does not exist
+    string edgeType = "", target = ""; // edge ops: type name and target record ID
+
+    bool edgeOp() const { return kind == AddEdge || kind == RemoveEdge; }
+};
+
+void to_json(json &j, const WriteOp &op) {
+    static const char *names[] = {"upsert", "delete", "patch", "add_edge", "remove_edge"};
+    j = {{"op", names[op.kind]}, {"table", op.tableName}, {"id", op.recordID}};
+    if (op.ifVersion >= 0) j["if_version"] = op.ifVersion;
+    if (op.ifAbsent) j["if_absent"] = true;
+    if (op.edgeOp()) {
+        j["type"] = op.edgeType;
+        j["to"] = op.target;
+        return;
+    }
+    if (op.kind == WriteOp::Delete) return;
+    j["fields"] = op.fields;
+    if (op.kind == WriteOp::Patch) return;
+    j["embedding"] = op.embedding;
+    if (!op.ns.empty()) j["namespace"] = op.ns;
+}
+
+void from_json(const json &j, WriteOp &op) {
+    string kind = j.value("op", "upsert");
+    if (kind == "delete") op.kind = WriteOp::Delete;
+    else if (kind == "insert" || kind == "update" || kind == "upsert") op.kind = WriteOp::Upsert;
+    else if (kind == "patch") op.kind = WriteOp::Patch;
+    else if (kind == "add_edge") op.kind = WriteOp::AddEdge;
+    else if (kind == "remove_edge") op.kind = WriteOp::RemoveEdge;
+    else throw runtime_error("unknown op " + kind);
+    op.tableName = j.at("table").get<string>();
+    op.recordID = j.at("id").get<string>();
+    op.ifVersion = j.value("if_version", op.ifVersion);
+    op.ifAbsent = j.value("if_absent", op.ifAbsent);
+    if (op.ifVersion >= 0 && op.ifAbsent) throw runtime_error("if_version and if_absent are exclusive");
+    if (op.edgeOp()) {
+        op.edgeType = j.at("type").get<string>();
+        op.target = j.at("to").get<string>();
+        return;
+    }
+    if (op.kind == WriteOp::Delete) return;
+    op.fields = j.value("fields", unordered_map<string,string>{});
+    if (op.kind == WriteOp::Patch) return;
+    op.embedding = j.at("embedding").get<vector<float>>();
+    op.ns = j.value("namespace", "");
+}
+
+// Per-request edge traversal knobs
+struct EdgeFilter {
+    vector<string> types;     // edge types to follow, empty = all
+    string direction = "out"; // "out", "in" or "both"
+    string field, value;      // only visit records with this field value
+};
+
+// --- Data Structures ---
+struct Record {
+    unordered_map<string,string> fields;
+    vector<float> embedding;   // fp32 tables
+    size_t label;
+    string ns; // namespace, "" = table default
+    vector<uint16_t> packed;   // fp16/bf16 tables; embedding stays empty
+    uint64_t seq = 0;          // write that produced this version
+    bool onDisk = false;       // vector served by the table's disk index; embedding and packed are empty
+};
+
+// A superseded record version, current from rec.seq until write `to` replaced it
+struct RecordVersion {
+    Record rec;
+    uint64_t to;
+};
+
+// Per-tenant partition of a table with its own vector index and field postings
+struct Namespace {
+    unique_ptr<hnswlib::AlgorithmInterface<float>> index;
+    bool graph = false; // false: BruteforceSearch, true: HierarchicalNSW
+    unordered_set<string> ids;
+    FieldIndex fieldIndex;
+    BinaryCodes binary;
+};
+
+struct Table {
+    unordered_map<string,Record> records;
+    unique_ptr<hnswlib::SpaceInterface<float>> space;
+    unique_ptr<hnswlib::HierarchicalNSW<float>> index;
+    unordered_map<size_t,string> labelToID;
+    size_t nextLabel = 0;
+    int dim = 0;
+
+    FieldIndex fieldIndex; // default namespace
+    BinaryCodes binary;    // default namespace, only with config.binaryQuantization
+    unordered_map<string,Namespace> namespaces;
+    TableConfig config;
+
+    // Default namespace as of the last disk build; `index` then only holds newer writes
+    unique_ptr<DiskGraphIndex> disk;
+
+    size_t reorderedNodes = 0; // graph nodes at the last reorder
+
+    struct { size_t checked = 0, rejected = 0, merged = 0; } dedup; // since startup
+
+    EdgeIndex edges;
+
+    // Superseded versions by record ID, oldest first; deleted records keep their last version
+    unordered_map<string,vector<RecordVersion>> history;
+
+    uint64_t snapshotSeq = 0; // last write contained in the snapshot the table was loaded from
+};
+
+// Long-running server-side task. Progress counters are polled by /jobs; the body checks
+// `cancel` between units of work.
+struct Job {
+    string id, kind, table;
+    atomic<size_t> done{0}, total{0};
+    atomic<bool> cancel{false};
+    chrono::steady_clock::time_point started = chrono::steady_clock::now(), finished;
+    // Guarded by MidDB::jobsMutex
+    string state = "running"; // running, done, cancelled, failed
+    string error;
+    json result;
+    thread runner;
+};
+
+// --- Tracing ---
+// Spans in Chrome trace event format ("X" events), appended to a JSON array file that
+// chrome://tracing and Perfetto load as is. Trace IDs come from a W3C `traceparent` request
+// header or are generated for a sampled share of requests; nothing is recorded while disabled.
+class Tracer {
+public:
+    struct Span {
+        string traceId, id, parentId;   // traceId empty = not traced
+        string name;
+        chrono::steady_clock::time_point start;
+        json args;
+        explicit operator bool() const { return !traceId.empty(); }
+    };
+
+    void configure(const string &file, bool on, double rate) {
+        lock_guard<mutex> lock(m);
+        if (on && !out.is_open()) {
+            bool fresh = !fs::exists(file) || fs::file_size(file) == 0;
+            out.open(file, ios::app);
+            if (fresh) out << "[\n";
+        }
+        if (!on && out.is_open()) out.close();
+        path = file;
+        sampleRate = rate;
+        enabled = on;
+    }
+
+    json config() const {
+        lock_guard<mutex> lock(m);
+        return {{"enabled", enabled.load()}, {"sampleRate", sampleRate}, {"file", path}, {"spans", spans}};
+    }
+
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    }
+
+    // W3C traceparent "00-<32 hex trace-id>-<16 hex parent-id>-<2 hex flags>", lowercase, ids not all
+    // zero. Anything else is ignored rather than rejected, as the spec requires.
+    static bool validTraceparent(const string &header) {
+        if (header.size() != 55 || header.compare(0, 3, "00-") != 0 || header[35] != '-' || header[52] != '-')
+            return false;
+        auto hexField = [&](size_t pos, size_t len) {
+            bool nonZero = false;
+            for (size_t i = pos; i < pos + len; i++) {
+                int v = hexValue(header[i]);
+                if (v < 0) return false;
+                nonZero |= v != 0;
+            }
+            return nonZero || len == 2;  // flags may be 00
+        };
+        return hexField(3, 32) && hexField(36, 16) && hexField(53, 2);
+    }
+
+    // Span of a request; traced if the header's sampled flag is set or the request is sampled
+    Span root(const string &traceparent, const string &name) {
+        Span span;
+        if (!enabled) return span;
+        bool valid = validTraceparent(traceparent);
+        if (valid && (hexValue(traceparent[54]) & 1)) {
+            span.traceId = traceparent.substr(3, 32);
+            span.parentId = traceparent.substr(36, 16);
+        } else if (sampled()) {
+            span.traceId = valid ? traceparent.substr(3, 32) : randomHex(32);
+        } else {
+            return span;
+        }
+        span.id = randomHex(16);
+        span.name = name;
+        span.start = chrono::steady_clock::now();
+        return span;
+    }
+
+    static Span child(const Span &parent, const string &name,
+                      chrono::steady_clock::time_point start = chrono::steady_clock::now()) {
+        if (!parent) return {};
+        return {parent.traceId, randomHex(16), parent.id, name, start, {}};
+    }
+
+    void end(const Span &span, chrono::steady_clock::time_point finish = chrono::steady_clock::now()) {
+        if (!span || !enabled) return;
+        static const auto epoch = chrono::system_clock::now().time_since_epoch() -
+                                  chrono::duration_cast<chrono::system_clock::duration>(chrono::steady_clock::now().time_since_epoch());
+        auto micros = [](auto d) { return chrono::duration_cast<chrono::microseconds>(d).count(); };
+        json args = span.args.is_null() ? json::object() : span.args;
+        args["traceId"] = span.traceId;
+        args["spanId"] = span.id;
+        if (!span.parentId.empty()) args["parentId"] = span.parentId;
+        json event = {{"name", span.name}, {"ph", "X"}, {"pid", getpid()}, {"tid", threadNumber()},
+                      {"ts", micros(span.start.time_since_epoch() + epoch)}, {"dur", micros(finish - span.start)},
+                      {"args", args}};
+        lock_guard<mutex> lock(m);
+        if (!out.is_open()) return;
+        out << event.dump() << ",\n" << flush;
+        spans++;
+    }
+
+    // Query profile stages as consecutive child spans of the request
+    void stages(const Span &parent, const QueryProfile &profile) {
+        if (!parent || profile.stages.is_null()) return;
+        auto at = profile.started;
+        for (auto &stage : profile.stages) {
+            auto finish = at + chrono::duration_cast<chrono::steady_clock::duration>(
+                                   chrono::duration<double, micro>(stage["micros"].get<double>()));
+            end(child(parent, stage["stage"].get<string>(), at), finish);
+            at = finish;
+        }
+    }
+
+    static string traceparent(const Span &span) { return "00-" + span.traceId + "-" + span.id + "-01"; }
+
+private:
+    mutable mutex m;
+    atomic<bool> enabled{false};
+    double sampleRate = 0;
+    string path;
+    ofstream out;
+    size_t spans = 0;
+
+    bool sampled() {
+        thread_local mt19937 rng(random_device{}());
+        lock_guard<mutex> lock(m);
+        return sampleRate > 0 && uniform_real_distribution<double>(0, 1)(rng) < sampleRate;
+    }
+
+    static string randomHex(size_t digits) {
+        thread_local mt19937_64 rng(random_device{}());
+        static const char *hex = "0123456789abcdef";
+        string s(digits, '0');
+        for (auto &c : s) c = hex[rng() & 15];
+        return s;
+    }
+
+    // Small stable thread numbers for the trace viewer's rows
+    static int threadNumber() {
+        static atomic<int> next{1};
+        thread_local int number = next++;
+        return number;
+    }
+};
+
+// --- MidDB Class ---
+class MidDB {
+private:
+    unordered_map<string,Table> tables;
+    string storageDir = "data";
+    mutable shared_mutex dbMutex; // for shared read access
+
+    // Async writes. A task is one /insert, /update, /delete or /batch call: its ops share a
+    // sequence number and a WAL line and are applied under one exclusive lock.
+    struct WriteTask {
+        uint64_t seq = 0;
+        vector<WriteOp> ops;
+        Tracer::Span trace;     // span of the submitting request, if traced
+        chrono::steady_clock::time_point queued;
+    };
+    deque<WriteTask> writeQueue;
+    mutex queueMutex;               // for the queue, nextSeq, the WAL and the condition_variables
+    condition_variable cv;
+    uint64_t nextSeq = 1;
+    atomic<uint64_t> appliedSeq{0};
+    int walFd = -1;                 // queued tasks not yet in a snapshot, one JSON line each
+    deque<WriteTask> walStaged;     // logged, queued in order once an fdatasync covers them
+    uint64_t walSynced = 0;         // last sequence number known to be on disk
+    bool walSyncing = false;
+    condition_variable walCv;
+    bool stopWorker = false;
+    thread workerThread;
+
+    // Outcome of recent writes by sequence number, for /ack
+    static constexpr size_t ACK_HISTORY = 10000;
+    mutable mutex ackMutex;
+    condition_variable ackCv;
+    map<uint64_t,json> acks;
+
+    // Change feed: applied mutations in sequence order, appended to data/cdc.log and the most
+    // recent ones kept in memory for /changes. cdc.log is rotated into segments
+    // cdc.<from>-<to>.log (changes after write from, up to write to); the newest CDC_SEGMENTS stay.
+    static constexpr size_t CDC_BUFFER = 10000;
+    static constexpr size_t CDC_SEGMENT_BYTES = 64 << 20;
+    static constexpr size_t CDC_SEGMENTS = 8;
+    vector<json> capturedChanges;   // of the write being applied, under dbMutex
+    mutable mutex cdcMutex;
+    condition_variable cdcCv;
+    deque<json> cdcEvents;
+    uint64_t cdcSeq = 0;            // last sequence number in the feed
+    uint64_t cdcTrimmed = 0;        // last sequence number dropped from memory
+    uint64_t cdcLogFrom = 0;        // cdc.log holds the changes after this write
+    uint64_t cdcFloor = 0;          // the oldest segment holds the changes after this write
+    size_t cdcLogBytes = 0;
+    ofstream cdcLog;
+    mutable shared_mutex cdcFilesMutex; // readers of the log files against rotation
+
+    // Standing similarity queries, matched against every written embedding of their table
+    struct Subscription;
+    struct SubscriptionMatrix;
+    mutable mutex subsMutex;        // taken after dbMutex
+    condition_variable subsCv;
+    map<size_t,shared_ptr<Subscription>> subscriptions;
+    unordered_map<string,SubscriptionMatrix> subsByTable;
+    size_t nextSubscription = 1;
+
+    Tracer tracer;
+
+    // Background ef tuning; shares stopWorker
+    condition_variable tunerCv;
+    thread tunerThread;
+
+    mutable mutex jobsMutex;
+    map<size_t,shared_ptr<Job>> jobs;
+    size_t nextJob = 1;
+
+    mutex diskBuildsMutex;
+    set<string> diskBuilds; // tables with a disk index build running
+
+    string tableFile(const string &tableName) { return storageDir + "/" + tableName + ".json"; }
+    string indexFile(const string &tableName) { return storageDir + "/" + tableName + ".index"; }
+    string edgesFile(const string &tableName) { return storageDir + "/" + tableName + ".edges"; }
+    string diskFile(const string &tableName) { return storageDir + "/" + tableName + ".diskann"; }
+    string metaFile(const string &tableName) { return storageDir + "/" + tableName + ".meta"; }
+    string historyFile(const string &tableName) { return storageDir + "/" + tableName + ".history"; }
+    string walFile() { return storageDir + "/wal.log"; }
+    string cdcFile() const { return storageDir + "/cdc.log"; }
+
+    void worker() {
+        vector<WriteTask> batch;
+        while (true) {
+            {
+                unique_lock<mutex> lock(queueMutex);
+                cv.wait_for(lock, chrono::seconds(5), [&]{ return !writeQueue.empty() || stopWorker; });
+                if (stopWorker && writeQueue.empty()) break;
+                batch.clear();
+                while (!writeQueue.empty() && batch.size() < 100) {
+                    batch.push_back(std::move(writeQueue.front()));
+                    writeQueue.pop_front();
+                }
+            }
+            // Traced tasks get their queue wait, the batch they ran in and its steps as spans
+            vector<Tracer::Span> batchSpans;
+            for (auto &task : batch) {
+                if (!task.trace) continue;
+                auto batchSpan = Tracer::child(task.trace, "worker.batch");
+                tracer.end(Tracer::child(task.trace, "queue", task.queued), batchSpan.start);
+                batchSpan.args = {{"seq", task.seq}, {"tasks", batch.size()}};
+                batchSpans.push_back(batchSpan);
+            }
+            size_t traced = 0;
+            for (auto &task : batch) {
+                auto applySpan = task.trace ? Tracer::child(batchSpans[traced++], "apply") : Tracer::Span{};
+                applyOrReject(task);
+                tracer.end(applySpan);
+            }
+            auto saveStart = chrono::steady_clock::now();
+            collectVersions();
+            reorderGrownTables();
+            saveAllTables();
+            if (!batch.empty()) truncateWal();
+            for (auto &span : batchSpans) {
+                tracer.end(Tracer::child(span, "save", saveStart));
+                tracer.end(span);
+            }
+        }
+    }
+
+    // --- Write-ahead log ---
+    static void appendWal(int fd, const string &line) {
+        for (size_t done = 0; done < line.size();) {
+            ssize_t n = ::write(fd, line.data() + done, line.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throw runtime_error(string("WAL write failed: ") + strerror(errno));
+            done += n;
+        }
+    }
+
+    // Moves the staged tasks up to seq into the write queue; the caller holds queueMutex
+    void releaseSynced(uint64_t seq) {
+        walSynced = max(walSynced, seq);
+        while (!walStaged.empty() && walStaged.front().seq <= walSynced) {
+            walStaged.front().queued = chrono::steady_clock::now();
+            writeQueue.push_back(std::move(walStaged.front()));
+            walStaged.pop_front();
+        }
+        walCv.notify_all();
+        cv.notify_one();
+    }
+
+    // Group commit: the first waiter syncs every line appended so far while the others wait for
+    // it, so concurrent writers share one fdatasync
+    void syncWal(unique_lock<mutex> &lock, uint64_t seq) {
+        while (walSynced < seq) {
+            if (walSyncing) {
+                walCv.wait(lock);
+                continue;
+            }
+            walSyncing = true;
+            uint64_t upTo = nextSeq - 1;
+            int fd = walFd;
+            lock.unlock();
+            int error = ::fdatasync(fd) == 0 ? 0 : errno;
+            lock.lock();
+            walSyncing = false;
+            if (error) {
+                walCv.notify_all();
+                throw runtime_error(string("WAL sync failed: ") + strerror(error));
+            }
+            releaseSynced(upTo);
+        }
+    }
+
+    // Rewrites the WAL with the tasks still queued once everything applied is in the snapshot.
+    // The first line only records the last applied sequence number. The new file is synced
+    // before it replaces the old one, which also makes the staged tasks durable.
+    void truncateWal() {
+        unique_lock<mutex> lock(queueMutex);
+        walCv.wait(lock, [&]{ return !walSyncing; }); // a sync in flight uses the old file
+        string tmp = walFile() + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        try {
+            if (fd < 0) throw runtime_error(string("cannot open ") + tmp + ": " + strerror(errno));
+            appendWal(fd, json{{"seq", appliedSeq.load()}, {"ops", json::array()}}.dump() + "\n");
+            for (auto *tasks : {&writeQueue, &walStaged})
+                for (auto &task : *tasks) appendWal(fd, json{{"seq", task.seq}, {"ops", task.ops}}.dump() + "\n");
+            if (::fdatasync(fd) != 0) throw runtime_error(string("WAL sync failed: ") + strerror(errno));
+        } catch (exception &e) {
+            if (fd >= 0) ::close(fd);
+            if (walFd >= 0) {
+                cerr << "[ERROR] Keeping the old WAL: " << e.what() << "\n";
+                return;
+            }
+            throw; // on startup there is no WAL to fall back to
+        }
+        fs::rename(tmp, walFile());
+        int dir = ::open(storageDir.c_str(), O_RDONLY);
+        if (dir >= 0) {
+            ::fsync(dir);
+            ::close(dir);
+        }
+        if (walFd >= 0) ::close(walFd);
+        walFd = fd;
+        releaseSynced(nextSeq - 1);
+    }
+
+    // Re-applies tasks logged after the last snapshot; runs before the worker starts
+    void replayWal() {
+        for (auto &[name, table] : tables) {
+            appliedSeq = max(appliedSeq.load(), table.snapshotSeq);
+            nextSeq = max(nextSeq, table.snapshotSeq + 1);
+        }
+        ifstream in(walFile());
+        size_t replayed = 0;
+        for (string line; getline(in, line);) {
+            if (line.empty()) continue;
+            json j;
+            try { j = json::parse(line); }
+            catch (exception &e) { cerr << "[WARN] Ignoring torn WAL record: " << e.what() << "\n"; break; }
+            WriteTask task;
+            task.seq = j["seq"].get<uint64_t>();
+            task.ops = j["ops"].get<vector<WriteOp>>();
+            nextSeq = max(nextSeq, task.seq + 1);
+            appliedSeq = max(appliedSeq.load(), task.seq);
+            // A crash between the snapshot and the WAL cut leaves tasks the snapshot already holds
+            task.ops.erase(remove_if(task.ops.begin(), task.ops.end(), [&](const WriteOp &op) {
+                auto tIt = tables.find(op.tableName);
+                return tIt != tables.end() && tIt->second.snapshotSeq >= task.seq;
+            }), task.ops.end());
+            if (task.ops.empty()) continue;
+            applyOrReject(task);
+            replayed++;
+        }
+        if (replayed) {
+            cout << "[INFO] Replayed " << replayed << " write(s) from " << walFile() << "\n";
+            saveAllTables();
+        }
+        truncateWal();
+    }
+
+    // Validates every op first, so a task is applied completely or not at all. Both ends of an
+    // edge must exist as the earlier ops of the write leave them.
+    string validateTask(const WriteTask &task) const {
+        unordered_map<string,size_t> dims;
+        map<pair<string,string>,bool> pending;
+        auto exists = [&](const string &tableName, const string &recordID) {
+            auto pIt = pending.find({tableName, recordID});
+            return pIt != pending.end() ? pIt->second : currentVersion(tableName, recordID) >= 0;
+        };
+        for (auto &op : task.ops) {
+            if (op.edgeOp()) {
+                if (op.edgeType.empty()) return op.recordID + ": edge type must not be empty";
+                for (auto *id : {&op.recordID, &op.target})
+                    if (!exists(op.tableName, *id)) return "unknown record " + *id;
+                continue;
+            }
+            if (op.kind == WriteOp::Delete) pending[{op.tableName, op.recordID}] = false;
+            if (op.kind != WriteOp::Upsert) continue;
+            pending[{op.tableName, op.recordID}] = true;
+            if (op.embedding.empty()) return op.recordID + ": empty embedding";
+            auto dIt = dims.find(op.tableName);
+            if (dIt == dims.end()) {
+                auto tIt = tables.find(op.tableName);
+                size_t dim = tIt != tables.end() && tIt->second.dim > 0 ? tIt->second.dim : op.embedding.size();
+                dIt = dims.emplace(op.tableName, dim).first;
+            }
+            if (op.embedding.size() != dIt->second)
+                return op.recordID + ": embedding has " + to_string(op.embedding.size()) + " dims, table " +
+                       op.tableName + " expects " + to_string(dIt->second);
+        }
+        return "";
+    }
+
+    int64_t currentVersion(const string &tableName, const string &recordID) const {
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) return -1;
+        auto recIt = tIt->second.records.find(recordID);
+        return recIt == tIt->second.records.end() ? -1 : (int64_t)recIt->second.seq;
+    }
+
+    // Checks if_version/if_absent against the records as the earlier ops of the write leave them.
+    // Returns the first conflict; ops gets each record's version before the op (null = absent).
+    string checkConditions(const WriteTask &task, json &ops) const {
+        map<pair<string,string>,int64_t> pending;
+        string error;
+        for (auto &op : task.ops) {
+            auto key = make_pair(op.tableName, op.recordID);
+            auto pIt = pending.find(key);
+            int64_t version = pIt != pending.end() ? pIt->second : currentVersion(op.tableName, op.recordID);
+            bool conflict = (op.ifAbsent && version >= 0) || (op.ifVersion >= 0 && version != op.ifVersion);
+            json r = {{"id", op.recordID}, {"version", version < 0 ? json(nullptr) : json(version)}};
+            if (conflict) {
+                r["conflict"] = true;
+                if (error.empty()) error = op.recordID + ": version conflict";
+            }
+            ops.push_back(r);
+            if (op.kind == WriteOp::Delete) pending[key] = -1;
+            else if (op.kind == WriteOp::Upsert || (op.kind == WriteOp::Patch && version >= 0))
+                pending[key] = task.seq; // a patch needs the record; edges leave versions alone
+        }
+        return error;
+    }
+
+    void applyTask(const WriteTask &task) {
+        {
+            unique_lock<shared_mutex> lock(dbMutex);
+            json ack = {{"seq", task.seq}};
+            json ops = json::array();
+            map<string,size_t> dedupChecked;
+            string error = validateTask(task);
+            if (error.empty()) error = checkConditions(task, ops);
+            if (error.empty()) error = checkDuplicates(task, ops, dedupChecked);
+            if (!error.empty()) {
+                cerr << "[ERROR] Write " << task.seq << " rejected: " << error << "\n";
+                ack["status"] = "rejected";
+                ack["error"] = error;
+                if (!ops.empty()) ack["ops"] = ops;
+            } else {
+                capturedChanges.clear();
+                ack["status"] = "applied";
+                ack["ops"] = json::array();
+                for (auto &op : task.ops) {
+                    json r = {{"id", op.recordID}, {"version", task.seq}};
+                    if (op.edgeOp()) {
+                        r = {{"id", op.recordID}, {"type", op.edgeType}, {"to", op.target},
+                             {"changed", updateEdge(op, task.seq)}};
+                    } else if (op.kind == WriteOp::Delete) {
+                        removeRecord(op, task.seq);
+                        r["version"] = nullptr;
+                    } else if (op.kind == WriteOp::Patch) {
+                        if (!patchRecord(op, task.seq)) r["version"] = nullptr;
+                    } else {
+                        string survivor = upsertRecord(op, task.seq);
+                        if (survivor != op.recordID) r = {{"id", op.recordID}, {"version", nullptr},
+                                                          {"merged", {{"id", survivor}, {"version", task.seq}}}};
+                    }
+                    ack["ops"].push_back(r);
+                }
+                for (auto &[name, n] : dedupChecked) tables[name].dedup.checked += n;
+                publishChanges(task.seq);
+            }
+            lock_guard<mutex> ackLock(ackMutex); // the ack exists once appliedSeq covers it
+            acks[task.seq] = std::move(ack);
+            while (acks.size() > ACK_HISTORY) acks.erase(acks.begin());
+            appliedSeq = task.seq;
+        }
+        ackCv.notify_all();
+    }
+
+    // Applies a task and acks it as rejected if applying it threw, instead of taking the worker
+    // down. Ops applied before the failure stay applied and reach the change feed.
+    void applyOrReject(const WriteTask &task) {
+        try {
+            applyTask(task);
+            return;
+        } catch (exception &e) {
+            cerr << "[ERROR] Write " << task.seq << " failed: " << e.what() << "\n";
+            unique_lock<shared_mutex> lock(dbMutex);
+            publishChanges(task.seq);
+            lock_guard<mutex> ackLock(ackMutex);
+            acks[task.seq] = {{"seq", task.seq}, {"status", "rejected"}, {"error", e.what()}};
+            while (acks.size() > ACK_HISTORY) acks.erase(acks.begin());
+            appliedSeq = task.seq;
+        }
+        ackCv.notify_all();
+    }
+
+    // --- Change data capture ---
+    // Records a mutation of the write being applied; rec == nullptr for a delete
+    void captureChange(const string &tableName, const string &recordID, const Record *rec, uint64_t seq = 0) {
+        json e = {{"seq", rec ? rec->seq : seq}, {"op", rec ? "upsert" : "delete"}, {"table", tableName}, {"id", recordID}};
+        if (rec) {
+            e["fields"] = rec->fields;
+            e["embedding"] = embeddingOf(tables.at(tableName), *rec);
+            if (!rec->ns.empty()) e["namespace"] = rec->ns;
+        }
+        capturedChanges.push_back(std::move(e));
+    }
+
+    // Appends the captured changes to the feed; writes replayed from the WAL that already
+    // reached cdc.log before a restart are not emitted twice
+    void publishChanges(uint64_t seq) {
+        {
+            lock_guard<mutex> lock(cdcMutex);
+            if (seq <= cdcSeq || capturedChanges.empty()) return;
+            for (auto &e : capturedChanges) {
+                string line = e.dump() + "\n";
+                cdcLog << line;
+                cdcLogBytes += line.size();
+                cdcEvents.push_back(std::move(e));
+            }
+            cdcLog << flush;
+            cdcSeq = seq;
+            trimChanges();
+            if (cdcLogBytes >= CDC_SEGMENT_BYTES) rotateChanges();
+        }
+        capturedChanges.clear();
+        cdcCv.notify_all();
+    }
+
+    // Drops whole writes from the front of the in-memory feed
+    void trimChanges() {
+        while (cdcEvents.size() > CDC_BUFFER) {
+            uint64_t first = cdcTrimmed = cdcEvents.front()["seq"];
+            while (!cdcEvents.empty() && cdcEvents.front()["seq"] == first) cdcEvents.pop_front();
+        }
+    }
+
+    struct ChangeSegment { uint64_t from, to; string path; };
+
+    // Rotated segments, oldest first
+    vector<ChangeSegment> changeSegments() const {
+        vector<ChangeSegment> segments;
+        for (auto &p : fs::directory_iterator(storageDir)) {
+            unsigned long long from, to;
+            char tail;
+            if (sscanf(p.path().filename().c_str(), "cdc.%llu-%llu.lo%c", &from, &to, &tail) == 3 && tail == 'g')
+                segments.push_back({from, to, p.path().string()});
+        }
+        sort(segments.begin(), segments.end(), [](auto &a, auto &b) { return a.from < b.from; });
+        return segments;
+    }
+
+    // Moves cdc.log into a segment and drops the oldest segments beyond CDC_SEGMENTS; the
+    // caller holds cdcMutex
+    void rotateChanges() {
+        unique_lock<shared_mutex> files(cdcFilesMutex);
+        cdcLog.close();
+        fs::rename(cdcFile(), storageDir + "/cdc." + to_string(cdcLogFrom) + "-" + to_string(cdcSeq) + ".log");
+        cdcLogFrom = cdcSeq;
+        cdcLogBytes = 0;
+        cdcLog.open(cdcFile(), ios::app);
+        auto segments = changeSegments();
+        for (size_t i = 0; i + CDC_SEGMENTS < segments.size(); i++) fs::remove(segments[i].path);
+        if (segments.size() > CDC_SEGMENTS) segments.erase(segments.begin(), segments.end() - CDC_SEGMENTS);
+        cdcFloor = segments.empty() ? cdcLogFrom : segments.front().from;
+        cout << "[INFO] Rotated change log at write " << cdcSeq << "\n";
+    }
+
+    void loadChanges() {
+        auto segments = changeSegments();
+        if (!segments.empty()) {
+            cdcFloor = segments.front().from;
+            cdcSeq = cdcTrimmed = cdcLogFrom = segments.back().to; // older changes stay on disk
+        }
+        ifstream in(cdcFile());
+        for (string line; getline(in, line);) {
+            try {
+                auto e = json::parse(line);
+                cdcSeq = e["seq"];
+                cdcEvents.push_back(std::move(e));
+                cdcLogBytes += line.size() + 1;
+                trimChanges();
+            } catch (exception &e) {
+                cerr << "[WARN] Ignoring torn change record: " << e.what() << "\n";
+                break;
+            }
+        }
+        cdcLog.open(cdcFile(), ios::app);
+    }
+
+    // Changes of up to limit events after since from the segments and cdc.log; a write is never split
+    vector<json> changesFromLog(uint64_t since, size_t limit) const {
+        vector<json> out;
+        shared_lock<shared_mutex> files(cdcFilesMutex);
+        vector<string> paths;
+        for (auto &segment : changeSegments())
+            if (segment.to > since) paths.push_back(segment.path);
+        paths.push_back(cdcFile());
+        for (auto &path : paths) {
+            ifstream in(path);
+            for (string line; getline(in, line);) {
+                json e;
+                try { e = json::parse(line); } catch (exception &) { break; }
+                if (e["seq"] <= since) continue;
+                if (out.size() >= limit && e["seq"] != out.back()["seq"]) return out;
+                out.push_back(std::move(e));
+            }
+        }
+        return out;
+    }
+
+    // --- Record versions ---
+    // Keeps the version a write is about to replace if the table keeps versions
+    static void supersede(Table &table, const string &recordID, const Record &rec, uint64_t seq) {
+        if (!table.config.keepVersions) return;
+        auto &versions = table.history[recordID];
+        versions.push_back({rec, seq});
+        loadEmbedding(table, versions.back().rec); // the disk row is rewritten once the record changes
+    }
+
+    // Drops versions beyond keepVersions per record, oldest first
+    void collectVersions() {
+        unique_lock<shared_mutex> lock(dbMutex);
+        for (auto &[name, table] : tables) {
+            for (auto it = table.history.begin(); it != table.history.end();) {
+                auto &versions = it->second;
+                if (versions.size() > table.config.keepVersions)
+                    versions.erase(versions.begin(), versions.end() - table.config.keepVersions);
+                it = versions.empty() ? table.history.erase(it) : next(it);
+            }
+        }
+    }
+
+    // The caller holds dbMutex exclusively and has validated the op. Returns the surviving
+    // record's ID: task.recordID, or the record a near-duplicate was merged into.
+    string upsertRecord(const WriteOp &task, uint64_t seq) {
+        if (tables.find(task.tableName) == tables.end())
+            createTable(task.tableName, task.embedding.size());
+
+        auto &table = tables[task.tableName];
+        if (!table.space) {
+            table.dim = task.embedding.size();
+            table.space = makeSpace(table.config, table.dim);
+        }
+
+        size_t label;
+        auto recIt = table.records.find(task.recordID);
+        bool created = recIt == table.records.end();
+        bool moved = created; // new vector or namespace: subscriptions are matched again
+        vector<float> oldEmbedding;
+        vector<uint16_t> oldPacked;
+        if (created && table.config.dedup == DedupPolicy::Merge) {
+            string merged = mergeDuplicate(table, task, seq);
+            if (!merged.empty()) return merged;
+        }
+        if (recIt != table.records.end()) {
+            // Update existing record (preserve label)
+            supersede(table, task.recordID, recIt->second, seq);
+            label = recIt->second.label;
+            unindexFields(table, task.recordID, recIt->second);
+            if (recIt->second.ns != task.ns) {
+                removeVector(table, recIt->second.ns, label);
+                moved = true;
+            }
+            moved = moved || recIt->second.onDisk; // not read back from disk just to compare
+            oldEmbedding = std::move(recIt->second.embedding);
+            oldPacked = std::move(recIt->second.packed);
+            recIt->second.fields = task.fields;
+            recIt->second.ns = task.ns;
+        } else {
+            // Insert new record
+            label = table.nextLabel++;
+            auto &fresh = table.records[task.recordID];
+            fresh.fields = task.fields;
+            fresh.label = label;
+            fresh.ns = task.ns;
+        }
+        auto &rec = table.records[task.recordID];
+        rec.seq = seq;
+        storeEmbedding(table, rec, task.embedding);
+        moved = moved || rec.embedding != oldEmbedding || rec.packed != oldPacked;
+        table.labelToID[label] = task.recordID;
+
+        // Update structured index
+        indexFields(table, task.recordID, rec);
+
+        // Add to the namespace's vector index
+        addVector(table, rec);
+        captureChange(task.tableName, task.recordID, &rec);
+        if (moved) matchSubscriptions(task.tableName, table, task.recordID, rec, created);
+
+        cout << "[INFO] Inserted/Updated " << task.recordID << " into " << task.tableName
+             << (task.ns.empty() ? "" : "/" + task.ns) << " (label=" << label << ")\n";
+        return task.recordID;
+    }
+
+    // Merges the op's fields into an existing record; false if there is none. The caller holds
+    // dbMutex exclusively.
+    bool patchRecord(const WriteOp &op, uint64_t seq) {
+        auto tIt = tables.find(op.tableName);
+        if (tIt == tables.end()) return false;
+        auto &table = tIt->second;
+        auto recIt = table.records.find(op.recordID);
+        if (recIt == table.records.end()) return false;
+        auto &rec = recIt->second;
+        supersede(table, op.recordID, rec, seq);
+        unindexFields(table, op.recordID, rec);
+        for (auto &[key, val] : op.fields) rec.fields[key] = val;
+        rec.seq = seq;
+        indexFields(table, op.recordID, rec);
+        captureChange(op.tableName, op.recordID, &rec); // the vector is unchanged: no subscription match
+        return true;
+    }
+
+    // Nearest record of the op's namespace within dedupDistance, or "". Records in `skip` are
+    // ignored (changed earlier in the same write).
+    string nearDuplicate(const Table &table, const WriteOp &op, const set<string> &skip = {}) const {
+        QueryOptions opts;
+        opts.ns = op.ns;
+        auto hits = searchHits(op.tableName, table, prepareQuery(table, op.embedding), 1 + skip.size(), opts);
+        sort(hits.begin(), hits.end());
+        for (auto &[dist, label] : hits) {
+            if (dist > table.config.dedupDistance) break;
+            auto idIt = table.labelToID.find(label);
+            if (idIt != table.labelToID.end() && !skip.count(idIt->second)) return idIt->second;
+        }
+        return "";
+    }
+
+    // Reject policy, checked before a write is applied so that a batch with a duplicate is
+    // rejected as a whole. New records are compared with the index and with the records
+    // written by the earlier ops of the same write. Returns the first duplicate. Probes are
+    // counted in `checked` by table, for the caller to add once the write is applied; only
+    // the probe that rejects the write is counted here.
+    string checkDuplicates(const WriteTask &task, json &ops, map<string,size_t> &checked) {
+        struct Written { const WriteOp *op; QueryVector qv; };
+        map<string,vector<Written>> written;  // by table
+        map<string,set<string>> changed;
+        string error;
+        for (size_t i = 0; i < task.ops.size() && error.empty(); i++) {
+            auto &op = task.ops[i];
+            auto tIt = tables.find(op.tableName);
+            bool reject = tIt != tables.end() && tIt->second.space && tIt->second.config.dedup == DedupPolicy::Reject;
+            if (op.kind == WriteOp::Upsert && reject) {
+                auto &table = tIt->second;
+                auto qv = prepareQuery(table, op.embedding);
+                if (ops[i]["version"].is_null()) {  // creates the record
+                    checked[op.tableName]++;
+                    string duplicate = nearDuplicate(table, op, changed[op.tableName]);
+                    auto distance = table.space->get_dist_func();
+                    void *param = table.space->get_dist_func_param();
+                    for (auto &w : written[op.tableName])
+                        if (duplicate.empty() && w.op->ns == op.ns && w.op->recordID != op.recordID &&
+                            distance(qv.data(), w.qv.data(), param) <= table.config.dedupDistance)
+                            duplicate = w.op->recordID;
+                    if (!duplicate.empty()) {
+                        table.dedup.checked++;
+                        table.dedup.rejected++;
+                        ops[i]["duplicate"] = duplicate;
+                        error = op.recordID + ": duplicate of " + duplicate;
+                        cout << "[INFO] Rejected " << op.recordID << " as duplicate of " << duplicate << "\n";
+                    }
+                }
+                written[op.tableName].push_back({&op, std::move(qv)});
+            }
+            if (!op.edgeOp()) changed[op.tableName].insert(op.recordID);
+        }
+        return error;
+    }
+
+    // Merge policy: folds a new record's fields into its nearest record within dedupDistance.
+    // Returns that record's ID, or "" if the record is not a duplicate.
+    string mergeDuplicate(Table &table, const WriteOp &task, uint64_t seq) {
+        table.dedup.checked++;
+        string existing = nearDuplicate(table, task);
+        if (existing.empty()) return existing;
+        auto &rec = table.records.at(existing);
+        supersede(table, existing, rec, seq);
+        unindexFields(table, existing, rec);
+        for (auto &[key, val] : task.fields) rec.fields[key] = val;
+        rec.seq = seq;
+        indexFields(table, existing, rec);
+        captureChange(task.tableName, existing, &rec);
+        table.dedup.merged++;
+        cout << "[INFO] Merged " << task.recordID << " into " << existing << "\n";
+        return existing;
+    }
+
+    // --- Embedding storage ---
+    // Cosine tables keep unit-normalized vectors so the IP kernels apply everywhere
+    static void storeEmbedding(const Table &table, Record &rec, vector<float> embedding) {
+        if (table.config.metric == Metric::Cosine) normalize(embedding);
+        if (table.config.precision == Precision::FP32) { rec.embedding = std::move(embedding); rec.packed.clear(); }
+        else { rec.packed = packEmbedding(embedding, table.config.precision); rec.embedding.clear(); }
+        rec.onDisk = false;
+    }
+
+    static vector<float> embeddingOf(const Table &table, const Record &rec) {
+        if (rec.onDisk) return table.disk->vectorOf(rec.label);
+        if (table.config.precision == Precision::FP32) return rec.embedding;
+        return unpackEmbedding(rec.packed, table.config.precision);
+    }
+
+    // Brings a disk-resident vector back into memory; the disk index holds it unpacked, so
+    // packing it again restores the original bits
+    static void loadEmbedding(const Table &table, Record &rec) {
+        if (!rec.onDisk) return;
+        auto embedding = table.disk->vectorOf(rec.label);
+        if (table.config.precision == Precision::FP32) rec.embedding = std::move(embedding);
+        else rec.packed = packEmbedding(embedding, table.config.precision);
+        rec.onDisk = false;
+    }
+
+    // Frees the in-memory copy of a vector the disk index serves
+    static void evictEmbedding(Record &rec) {
+        vector<float>().swap(rec.embedding);
+        vector<uint16_t>().swap(rec.packed);
+        rec.onDisk = true;
+    }
+
+    // Record vector in the table's index format; the record must not be disk-resident
+    static const void *storedData(const Table &table, const Record &rec) {
+        if (table.config.precision == Precision::FP32) return rec.embedding.data();
+        return rec.packed.data();
+    }
+
+    // Query in the table's index format: normalized for cosine, packed for fp16/bf16
+    struct QueryVector {
+        vector<float> values;
+        vector<uint16_t> packed;
+        const void *data() const { return packed.empty() ? (const void*)values.data() : packed.data(); }
+    };
+
+    static QueryVector prepareQuery(const Table &table, const vector<float> &embedding) {
+        QueryVector q{embedding, {}};
+        if (table.config.metric == Metric::Cosine) normalize(q.values);
+        if (table.config.precision != Precision::FP32) q.packed = packEmbedding(q.values, table.config.precision);
+        return q;
+    }
+
+    // Copy of a record vector in the table's index format, read from the disk index if needed
+    static QueryVector storedVector(const Table &table, const Record &rec) {
+        QueryVector v{embeddingOf(table, rec), {}};
+        if (table.config.precision != Precision::FP32) v.packed = packEmbedding(v.values, table.config.precision);
+        return v;
+    }
+
+    // --- Live subscriptions ---
+    struct Subscription {
+        size_t id;
+        string table, ns;
+        float maxDistance;
+        vector<float> embedding;    // as given, to re-prepare the query if the table's format changes
+        QueryVector query;
+        deque<json> matches;        // undelivered, oldest dropped beyond MAX_PENDING
+        size_t matched = 0, dropped = 0;
+        bool cancelled = false;
+        static constexpr size_t MAX_PENDING = 1000;
+    };
+
+    // One row per subscription in the table's index format, scanned with the batched kernels
+    struct SubscriptionMatrix {
+        vector<shared_ptr<Subscription>> subs;
+        vector<const void*> rows;
+    };
+
+    // The caller holds dbMutex exclusively
+    void matchSubscriptions(const string &tableName, const Table &table, const string &recordID,
+                            const Record &rec, bool created) {
+        {
+            lock_guard<mutex> lock(subsMutex);
+            auto mIt = subsByTable.find(tableName);
+            if (mIt == subsByTable.end() || mIt->second.rows.empty()) return;
+            auto &matrix = mIt->second;
+            vector<float> dists(matrix.rows.size());
+            static_cast<const VectorSpace&>(*table.space).distances(storedData(table, rec), matrix.rows.data(),
+                                                                    matrix.rows.size(), dists.data());
+            for (size_t j = 0; j < dists.size(); j++) {
+                auto &sub = *matrix.subs[j];
+                if (dists[j] > sub.maxDistance || sub.ns != rec.ns) continue;
+                json m = {{"subscription", sub.id}, {"id", recordID}, {"distance", dists[j]},
+                          {"op", created ? "insert" : "update"}, {"seq", rec.seq}, {"fields", rec.fields}};
+                sub.matches.push_back(std::move(m));
+                sub.matched++;
+                if (sub.matches.size() > Subscription::MAX_PENDING) { sub.matches.pop_front(); sub.dropped++; }
+            }
+        }
+        subsCv.notify_all();
+    }
+
+    // Re-prepares the table's subscription rows after a precision or metric change
+    void repackSubscriptions(const string &tableName, const Table &table) {
+        lock_guard<mutex> lock(subsMutex);
+        auto mIt = subsByTable.find(tableName);
+        if (mIt == subsByTable.end()) return;
+        auto &matrix = mIt->second;
+        for (size_t j = 0; j < matrix.subs.size(); j++) {
+            matrix.subs[j]->query = prepareQuery(table, matrix.subs[j]->embedding);
+            matrix.rows[j] = matrix.subs[j]->query.data();
+        }
+    }
+
+    static json subscriptionJson(const Subscription &sub) {
+        json j = {{"id", sub.id}, {"table", sub.table}, {"maxDistance", sub.maxDistance},
+                  {"pending", sub.matches.size()}, {"matched", sub.matched}, {"dropped", sub.dropped}};
+        if (!sub.ns.empty()) j["namespace"] = sub.ns;
+        return j;
+    }
+
+    shared_ptr<Subscription> findSubscription(size_t id) const {
+        auto it = subscriptions.find(id);
+        if (it == subscriptions.end()) throw runtime_error("unknown subscription " + to_string(id));
+        return it->second;
+    }
+
+    // --- Namespace partitions ---
+    FieldIndex &postings(Table &table, const string &ns) {
+        return ns.empty() ? table.fieldIndex : table.namespaces[ns].fieldIndex;
+    }
+
+    void indexFields(Table &table, const string &recordID, const Record &rec) {
+        auto &fieldIndex = postings(table, rec.ns);
+        for (auto &[key,val] : rec.fields)
+            fieldIndex[key][val].insert(recordID);
+        if (!rec.ns.empty()) table.namespaces[rec.ns].ids.insert(recordID);
+    }
+
+    void unindexFields(Table &table, const string &recordID, const Record &rec) {
+        auto &fieldIndex = postings(table, rec.ns);
+        for (auto &[key,val] : rec.fields) {
+            auto fIt = fieldIndex.find(key);
+            if (fIt == fieldIndex.end()) continue;
+            auto vIt = fIt->second.find(val);
+            if (vIt == fIt->second.end()) continue;
+            vIt->second.erase(recordID);
+            if (vIt->second.empty()) fIt->second.erase(vIt);
+        }
+        if (!rec.ns.empty()) table.namespaces[rec.ns].ids.erase(recordID);
+    }
+
+    // Doubles HNSW capacity when full instead of failing the insert
+    static void reserveIndex(hnswlib::HierarchicalNSW<float> &index) {
+        if (index.getCurrentElementCount() >= index.getMaxElements())
+            index.resizeIndex(index.getMaxElements() * 2);
+    }
+
+    void addVector(Table &table, const Record &rec) {
+        const string &ns = rec.ns;
+        if (table.config.binaryQuantization)
+            (ns.empty() ? table.binary : table.namespaces[ns].binary).add(rec.label, embeddingOf(table, rec));
+        if (ns.empty()) {
+            if (!table.index)
+                table.index.reset(new hnswlib::HierarchicalNSW<float>(table.space.get(), 20000));
+            reserveIndex(*table.index);
+            table.index->addPoint(storedData(table, rec), rec.label);
+            return;
+        }
+        auto &part = table.namespaces[ns];
+        if (!part.index)
+            part.index.reset(new hnswlib::BruteforceSearch<float>(table.space.get(), NAMESPACE_FLAT_LIMIT));
+        else if (!part.graph && part.ids.size() > NAMESPACE_FLAT_LIMIT)
+            promoteNamespace(table, part);
+        if (part.graph) reserveIndex(static_cast<hnswlib::HierarchicalNSW<float>&>(*part.index));
+        part.index->addPoint(storedData(table, rec), rec.label);
+    }
+
+    void removeVector(Table &table, const string &ns, size_t label) {
+        (ns.empty() ? table.binary : table.namespaces[ns].binary).remove(label);
+        if (ns.empty()) {
+            // Soft delete from HNSW (ghost label will exist); disk-resident labels are
+            // filtered at query time instead
+            if (table.index && table.index->label_lookup_.count(label)) table.index->markDelete(label);
+            return;
+        }
+        auto &part = table.namespaces[ns];
+        if (!part.index) return;
+        if (part.graph) static_cast<hnswlib::HierarchicalNSW<float>&>(*part.index).markDelete(label);
+        else static_cast<hnswlib::BruteforceSearch<float>&>(*part.index).removePoint(label);
+    }
+
+    // Rebuilds a namespace that outgrew the flat index as HNSW
+    void promoteNamespace(Table &table, Namespace &part) {
+        auto graph = make_unique<hnswlib::HierarchicalNSW<float>>(table.space.get(), 2 * part.ids.size());
+        for (auto &id : part.ids) {
+            auto &rec = table.records[id];
+            graph->addPoint(storedData(table, rec), rec.label);
+        }
+        part.index = std::move(graph);
+        part.graph = true;
+    }
+
+    // Indexes a loaded namespace in one pass over its records: flat up to NAMESPACE_FLAT_LIMIT,
+    // HNSW beyond, so a large namespace is not promoted halfway through the load
+    void loadNamespaceIndex(Table &table, Namespace &part) {
+        if (part.ids.size() > NAMESPACE_FLAT_LIMIT) {
+            promoteNamespace(table, part);
+            return;
+        }
+        part.index.reset(new hnswlib::BruteforceSearch<float>(table.space.get(), NAMESPACE_FLAT_LIMIT));
+        for (auto &id : part.ids) {
+            auto &rec = table.records[id];
+            part.index->addPoint(storedData(table, rec), rec.label);
+        }
+    }
+
+    // Disk hits are only valid for live default-namespace records not rewritten since the build
+    struct DiskLiveFilter : hnswlib::BaseFilterFunctor {
+        const Table &table;
+        explicit DiskLiveFilter(const Table &t) : table(t) {}
+        bool operator()(hnswlib::labeltype label) override {
+            auto it = table.labelToID.find(label);
+            if (it == table.labelToID.end() || !table.records.at(it->second).ns.empty()) return false;
+            return !(table.index && table.index->label_lookup_.count(label));
+        }
+    };
+
+    const BinaryCodes *binaryCodes(const Table &table, const string &ns) const {
+        if (ns.empty()) return &table.binary;
+        auto it = table.namespaces.find(ns);
+        return it == table.namespaces.end() ? nullptr : &it->second.binary;
+    }
+
+    void rebuildBinaryCodes(Table &table) {
+        table.binary.clear();
+        for (auto &[name, part] : table.namespaces) part.binary.clear();
+        if (!table.config.binaryQuantization) return;
+        for (auto &[id, rec] : table.records)
+            (rec.ns.empty() ? table.binary : table.namespaces[rec.ns].binary).add(rec.label, embeddingOf(table, rec));
+    }
+
+    const hnswlib::AlgorithmInterface<float> *vectorIndex(const Table &table, const string &ns) const {
+        if (ns.empty()) return table.index.get();
+        auto it = table.namespaces.find(ns);
+        return it == table.namespaces.end() ? nullptr : it->second.index.get();
+    }
+
+    // --- Graph reordering ---
+    static vector<HnswIndex*> graphIndices(Table &table) {
+        vector<HnswIndex*> graphs;
+        if (table.index) graphs.push_back(table.index.get());
+        for (auto &[name, part] : table.namespaces)
+            if (part.graph) graphs.push_back(static_cast<HnswIndex*>(part.index.get()));
+        return graphs;
+    }
+
+    static size_t graphNodes(Table &table) {
+        size_t nodes = 0;
+        for (auto graph : graphIndices(table)) nodes += graph->cur_element_count;
+        return nodes;
+    }
+
+    static void reorderIndices(Table &table) {
+        for (auto graph : graphIndices(table)) reorderGraph(*graph);
+        table.reorderedNodes = graphNodes(table);
+    }
+
+    void reorderGrownTables() {
+        unique_lock<shared_mutex> lock(dbMutex);
+        for (auto &[name, table] : tables) {
+            size_t nodes = graphNodes(table);
+            if (nodes < REORDER_MIN_NODES || nodes < 2 * table.reorderedNodes) continue;
+            reorderIndices(table);
+            cout << "[INFO] Reordered " << nodes << " graph nodes of " << name << "\n";
+        }
+    }
+
+    // Mean searchGraph latency over a sample of the table's own vectors
+    double sampleQueryMicros(const Table &table) const {
+        const size_t samples = 256;
+        size_t step = max<size_t>(1, table.records.size() / samples), i = 0, count = 0;
+        chrono::duration<double, micro> total{0};
+        for (auto &[id, rec] : table.records) {
+            if (i++ % step || rec.onDisk) continue;
+            auto graph = dynamic_cast<const HnswIndex*>(vectorIndex(table, rec.ns));
+            if (!graph) continue;
+            auto start = chrono::steady_clock::now();
+            searchGraph(*graph, static_cast<const VectorSpace&>(*table.space), storedData(table, rec), 10);
+            total += chrono::steady_clock::now() - start;
+            count++;
+        }
+        return count ? total.count() / count : 0;
+    }
+
+    // --- Vector search ---
+    static SearchParams searchParams(const Table &table, const QueryOptions &opts) {
+        SearchParams params = opts.search;
+        if (!params.ef) params.ef = table.config.ef;
+        return params;
+    }
+
+    // (distance, label) candidates for one prepared query; the caller holds dbMutex
+    vector<pair<float,size_t>> searchHits(const string &tableName, const Table &table, const QueryVector &qv,
+                                          int topK, const QueryOptions &opts, SearchStats *stats = nullptr) const {
+        vector<pair<float,size_t>> hits;
+        const void *query = qv.data();
+        if (opts.mode == "binary") {
+            // Hamming scan over sign bits, then exact re-rank on the stored embeddings
+            if (!table.config.binaryQuantization)
+                throw runtime_error("binary quantization is not enabled for table " + tableName);
+            auto codes = binaryCodes(table, opts.ns);
+            if (!codes) return hits;
+            auto distance = table.space->get_dist_func();
+            void *param = table.space->get_dist_func_param();
+            auto candidates = codes->nearest(qv.values, (size_t)topK * max(1, opts.oversample));
+            for (auto &[hamming, label] : candidates) {
+                auto &rec = table.records.at(table.labelToID.at(label));
+                if (!rec.onDisk) hits.emplace_back(distance(query, storedData(table, rec), param), label);
+                else hits.emplace_back(distance(query, storedVector(table, rec).data(), param), label);
+            }
+            if (stats) stats->distances += hits.size();
+            if (opts.profile) opts.profile->plan["index"] = {{"type", "binary"}, {"candidates", candidates.size()}};
+        } else if (opts.mode == "hnsw") {
+            auto index = vectorIndex(table, opts.ns);
+            if (auto graph = dynamic_cast<const HnswIndex*>(index)) {
+                hits = searchGraph(*graph, static_cast<const VectorSpace&>(*table.space), query, topK, searchParams(table, opts), nullptr, stats);
+                if (opts.profile)
+                    opts.profile->plan["index"] = {{"type", "hnsw"}, {"records", graph->cur_element_count.load()},
+                                                   {"ef", stats ? stats->ef : 0}};
+            } else if (index) {
+                auto labels = index->searchKnn(query, topK);
+                for (; !labels.empty(); labels.pop()) hits.push_back(labels.top());
+                size_t scanned = static_cast<const hnswlib::BruteforceSearch<float>*>(index)->cur_element_count;
+                if (stats) stats->distances += scanned;
+                if (opts.profile) opts.profile->plan["index"] = {{"type", "flat"}, {"records", scanned}};
+            }
+            size_t found = hits.size();
+            addDiskHits(table, qv, topK, opts, hits);
+            if (opts.profile && hits.size() > found) opts.profile->plan["diskHits"] = hits.size() - found;
+        } else {
+            throw runtime_error("unknown search mode " + opts.mode);
+        }
+        return hits;
+    }
+
+    void addDiskHits(const Table &table, const QueryVector &qv, int topK, const QueryOptions &opts,
+                     vector<pair<float,size_t>> &hits) const {
+        if (!opts.ns.empty() || !table.disk) return;
+        DiskLiveFilter live(table);
+        auto diskHits = table.disk->search(qv.values.data(), topK, max(64, 2 * topK), 4, &live);
+        // Disk distances are squared L2; on unit vectors that is 2 * (1 - cos)
+        float scale = table.config.metric == Metric::Cosine ? 0.5f : 1.0f;
+        for (auto &[dist, label] : diskHits) hits.emplace_back(dist * scale, label);
+    }
+
+    vector<string> rankedIDs(const Table &table, vector<pair<float,size_t>> &hits, int topK) const {
+        vector<string> result;
+        sort(hits.begin(), hits.end()); // nearest first
+        for (auto &[dist, label] : hits) {
+            auto it = table.labelToID.find(label);
+            if (it != table.labelToID.end()) result.push_back(it->second);
+            if (result.size() == (size_t)topK) break;
+        }
+        return result;
+    }
+
+    // Maximal marginal relevance over the fetched candidates. Similarity is the negated
+    // distance, so each pick maximizes
+    //   lambda * -d(query, c) + (1 - lambda) * min over picked s of d(c, s)
+    // for every metric. Distances to the latest pick are computed in one batched kernel pass.
+    vector<string> diversifiedIDs(const Table &table, vector<pair<float,size_t>> &hits, int topK, float lambda) const {
+        sort(hits.begin(), hits.end());
+        vector<pair<float,size_t>> pool;
+        vector<const void*> vecs;
+        deque<QueryVector> fromDisk; // stable addresses for disk-resident candidates
+        unordered_set<size_t> seen;
+        for (auto &[dist, label] : hits) {
+            auto it = table.labelToID.find(label);
+            if (it == table.labelToID.end() || !seen.insert(label).second) continue;
+            pool.push_back({dist, label});
+            auto &rec = table.records.at(it->second);
+            if (!rec.onDisk) vecs.push_back(storedData(table, rec));
+            else vecs.push_back(fromDisk.emplace_back(storedVector(table, rec)).data());
+        }
+        auto &space = static_cast<const VectorSpace&>(*table.space);
+        vector<float> nearestPick(pool.size(), numeric_limits<float>::infinity()), toPick(pool.size());
+        vector<char> picked(pool.size(), 0);
+        vector<string> result;
+        while (result.size() < (size_t)topK && result.size() < pool.size()) {
+            size_t best = 0;
+            float bestScore = -numeric_limits<float>::infinity();
+            for (size_t i = 0; i < pool.size(); i++) {
+                if (picked[i]) continue;
+                float score = -lambda * pool[i].first;
+                if (!result.empty()) score += (1 - lambda) * nearestPick[i];
+                if (score > bestScore) bestScore = score, best = i;
+            }
+            picked[best] = 1;
+            result.push_back(table.labelToID.at(pool[best].second));
+            space.distances(vecs[best], vecs.data(), vecs.size(), toPick.data());
+            for (size_t i = 0; i < pool.size(); i++) nearestPick[i] = min(nearestPick[i], toPick[i]);
+        }
+        return result;
+    }
+
+    static int fetchCount(int topK, const QueryOptions &opts) {
+        if (opts.mmrLambda >= 1) return topK;
+        return max(topK, opts.fetchK ? opts.fetchK : 4 * topK);
+    }
+
+    vector<string> rankedIDs(const Table &table, vector<pair<float,size_t>> &hits, int topK,
+                             const QueryOptions &opts) const {
+        if (opts.mmrLambda < 1) return diversifiedIDs(table, hits, topK, opts.mmrLambda);
+        return rankedIDs(table, hits, topK);
+    }
+
+    // --- ef auto-tuning ---
+    struct ExcludeLabel : hnswlib::BaseFilterFunctor {
+        size_t label;
+        explicit ExcludeLabel(size_t l) : label(l) {}
+        bool operator()(hnswlib::labeltype l) override { return l != label; }
+    };
+
+    static size_t defaultRecords(const Table &table) {
+        size_t n = table.records.size();
+        for (auto &[name, part] : table.namespaces) n -= part.ids.size();
+        return n;
+    }
+
+    vector<string> tablesDueForTuning() const {
+        vector<string> due;
+        shared_lock<shared_mutex> lock(dbMutex);
+        for (auto &[name, table] : tables) {
+            auto &c = table.config;
+            size_t n = defaultRecords(table);
+            if (c.recallTarget > 0 && table.index && !table.disk && n >= TUNE_MIN_RECORDS &&
+                (c.efTunedRecords == 0 || n >= c.efTunedRecords * 3 / 2))
+                due.push_back(name);
+        }
+        return due;
+    }
+
+    void tuner() {
+        unique_lock<mutex> lock(queueMutex);
+        while (!tunerCv.wait_for(lock, TUNE_INTERVAL, [&]{ return stopWorker; })) {
+            lock.unlock();
+            for (auto &name : tablesDueForTuning()) {
+                try { tuneEf(name); }
+                catch (exception &e) { cerr << "[WARN] ef tuning for " << name << ": " << e.what() << "\n"; }
+            }
+            lock.lock();
+        }
+    }
+
+    void saveMeta(const string &tableName) {
+        ofstream(metaFile(tableName)) << json(tables[tableName].config).dump(2);
+    }
+
+    void saveAllTables() {
+        shared_lock<shared_mutex> lock(dbMutex);
+        for (auto &p : tables) {
+            saveTable(p.first);
+            saveIndex(p.first);
+        }
+    }
+
+public:
+    MidDB() {
+        fs::create_directories(storageDir);
+        set<string> names;
+        for (auto &p : fs::directory_iterator(storageDir))
+            if (p.path().extension() == ".json" || p.path().extension() == ".meta")
+                names.insert(p.path().stem().string());
+        for (auto &name : names) loadTable(name);
+        loadChanges();
+        replayWal();
+        if (const char *rate = getenv("MIDDB_TRACE")) tracer.configure(storageDir + "/trace.json", true, atof(rate));
+        workerThread = thread([this]{ worker(); });
+        tunerThread = thread([this]{ tuner(); });
+    }
+
+    ~MidDB() {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopWorker = true;
+        }
+        cv.notify_all();
+        tunerCv.notify_all();
+        if(workerThread.joinable()) workerThread.join();
+        if(tunerThread.joinable()) tunerThread.join();
+        if (walFd >= 0) ::close(walFd);
+        vector<shared_ptr<Job>> running;
+        {
+            lock_guard<mutex> lock(jobsMutex);
+            for (auto &[id, job] : jobs) { job->cancel = true; running.push_back(job); }
+        }
+        for (auto &job : running) if (job->runner.joinable()) job->runner.join();
+    }
+
+    void createTable(const string &tableName, int dim = 0) {
+        if (tables.find(tableName) != tables.end()) return;
+        Table t; t.dim = dim;
+        if (dim > 0) t.space = makeSpace(t.config, dim);
+        tables[tableName] = std::move(t);
+    }
+
+    // Logs the ops to the WAL and queues them as one task; returns its sequence number
+    uint64_t submit(vector<WriteOp> ops, const Tracer::Span &trace = {}) {
+        if (ops.empty()) throw runtime_error("no ops");
+        auto walSpan = Tracer::child(trace, "wal");
+        unique_lock<mutex> lock(queueMutex);
+        WriteTask task;
+        task.seq = nextSeq++;
+        task.ops = std::move(ops);
+        task.trace = trace;
+        appendWal(walFd, json{{"seq", task.seq}, {"ops", task.ops}}.dump() + "\n");
+        uint64_t seq = task.seq;
+        walStaged.push_back(std::move(task));
+        syncWal(lock, seq);
+        tracer.end(walSpan);
+        return seq;
+    }
+
+    uint64_t insert(const string &tableName, const string &recordID,
+                    const unordered_map<string,string> &fields,
+                    const vector<float> &embedding, const string &ns = "") {
+        return submit({{WriteOp::Upsert, tableName, recordID, fields, embedding, ns}});
+    }
+
+    uint64_t update(const string &tableName, const string &recordID,
+                    const unordered_map<string,string> &fields,
+                    const vector<float> &embedding, const string &ns = "") {
+        return insert(tableName, recordID, fields, embedding, ns); // upsert via insert
+    }
+
+    uint64_t remove(const string &tableName, const string &recordID) {
+        return submit({{WriteOp::Delete, tableName, recordID, {}, {}, ""}});
+    }
+
+    uint64_t lastApplied() const { return appliedSeq; }
+
+    Tracer &tracing() { return tracer; }
+
+    // Enables span export to data/trace.json for a sampled share of requests (and those sent
+    // with a sampled traceparent), or disables it
+    json configureTracing(const json &j) {
+        auto current = tracer.config();
+        double rate = j.value("sampleRate", current["sampleRate"].get<double>());
+        if (rate < 0 || rate > 1) throw runtime_error("sampleRate must be between 0 and 1");
+        tracer.configure(storageDir + "/trace.json", j.value("enabled", current["enabled"].get<bool>()),
+                         rate);
+        return tracer.config();
+    }
+
+    // Applied changes after write since, waiting up to timeout for the first one
+    vector<json> changes(uint64_t since, size_t limit, chrono::milliseconds timeout = chrono::milliseconds(0)) {
+        unique_lock<mutex> lock(cdcMutex);
+        cdcCv.wait_for(lock, timeout, [&] { return cdcSeq > since; });
+        if (cdcSeq <= since) return {};
+        if (since < cdcFloor)
+            throw runtime_error("changes up to write " + to_string(cdcFloor) + " were rotated out");
+        if (since < cdcTrimmed) {
+            lock.unlock();
+            return changesFromLog(since, limit); // older than the in-memory feed
+        }
+        vector<json> out;
+        auto it = upper_bound(cdcEvents.begin(), cdcEvents.end(), since,
+                              [](uint64_t s, const json &e) { return s < e["seq"].get<uint64_t>(); });
+        for (; it != cdcEvents.end(); ++it) {
+            if (out.size() >= limit && (*it)["seq"] != out.back()["seq"]) break;
+            out.push_back(*it);
+        }
+        return out;
+    }
+
+    // Outcome of write seq, waiting up to timeout for it to be applied
+    json writeAck(uint64_t seq, chrono::milliseconds timeout = chrono::milliseconds(0)) {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            if (seq == 0 || seq >= nextSeq) throw runtime_error("unknown write " + to_string(seq));
+        }
+        unique_lock<mutex> lock(ackMutex);
+        ackCv.wait_for(lock, timeout, [&] { return appliedSeq >= seq; });
+        auto it = acks.find(seq);
+        if (it != acks.end()) return it->second;
+        return {{"seq", seq}, {"status", appliedSeq >= seq ? "expired" : "pending"}};
+    }
+
+    // Current version of a record (the sequence number of its last write)
+    json getRecord(const string &tableName, const string &recordID) const {
+        shared_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) throw runtime_error("unknown table " + tableName);
+        auto recIt = tIt->second.records.find(recordID);
+        if (recIt == tIt->second.records.end()) throw runtime_error("unknown record " + recordID);
+        auto &rec = recIt->second;
+        json j = {{"id", recordID}, {"version", rec.seq}, {"fields", rec.fields}};
+        if (!rec.ns.empty()) j["namespace"] = rec.ns;
+        return j;
+    }
+
+    // Retained versions of a record, oldest first, ending with the current one
+    json recordHistory(const string &tableName, const string &recordID) const {
+        shared_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) throw runtime_error("unknown table " + tableName);
+        auto &table = tIt->second;
+        json out = json::array();
+        auto version = [&](const Record &rec) {
+            json v = {{"seq", rec.seq}, {"fields", rec.fields}};
+            if (!rec.ns.empty()) v["namespace"] = rec.ns;
+            return v;
+        };
+        auto hIt = table.history.find(recordID);
+        if (hIt != table.history.end())
+            for (auto &v : hIt->second) out.push_back(version(v.rec));
+        auto recIt = table.records.find(recordID);
+        if (recIt != table.records.end()) out.push_back(version(recIt->second));
+        else if (!out.empty()) out.push_back({{"seq", hIt->second.back().to}, {"deleted", true}});
+        return out;
+    }
+
+    // The caller holds dbMutex exclusively
+    void removeRecord(const WriteOp &op, uint64_t seq) {
+        const string &tableName = op.tableName, &recordID = op.recordID;
+        if (tables.find(tableName) == tables.end()) return;
+        auto &table = tables[tableName];
+        auto it = table.records.find(recordID);
+        if (it == table.records.end()) return;
+
+        supersede(table, recordID, it->second, seq);
+        Record rec = std::move(it->second);
+        // Remove from main records
+        table.records.erase(it);
+        table.labelToID.erase(rec.label);
+
+        // Remove from structured and vector index
+        unindexFields(table, recordID, rec);
+        removeVector(table, rec.ns, rec.label);
+        table.edges.removeNode(rec.label);
+        captureChange(tableName, recordID, nullptr, seq);
+
+        cout << "[INFO] Deleted " << recordID << " from " << tableName << "\n";
+    }
+
+    vector<string> queryField(const string &tableName, const string &field, const string &value,
+                              const string &ns = "", QueryProfile *profile = nullptr) const {
+        vector<string> result;
+        shared_lock<shared_mutex> lock(dbMutex);
+        if (profile) profile->stage("lock");
+        if (tables.find(tableName) == tables.end()) return result;
+        const auto &table = tables.at(tableName);
+        const FieldIndex *fieldIndex = &table.fieldIndex;
+        if (!ns.empty()) {
+            auto nsIt = table.namespaces.find(ns);
+            fieldIndex = nsIt == table.namespaces.end() ? nullptr : &nsIt->second.fieldIndex;
+        }
+        if (fieldIndex) {
+            auto fit = fieldIndex->find(field);
+            if (fit != fieldIndex->end()) {
+                auto vit = fit->second.find(value);
+                if (vit != fit->second.end()) {
+                    result.reserve(vit->second.size());
+                    for (const auto &id : vit->second) result.push_back(id);
+                    if (profile) profile->stage("postings");
+                }
+            }
+        }
+        if (!result.empty()) {
+            sort(result.begin(), result.end());
+            if (profile) profile->stage("sort");
+        }
+        if (profile) {
+            size_t records = namespaceSize(table, ns);
+            profile->plan["filter"] = {{"field", field}, {"value", value}, {"matches", result.size()}, {"records", records},
+                                       {"selectivity", records ? double(result.size()) / records : 0.0}};
+        }
+        return result;
+    }
+
+    static size_t namespaceSize(const Table &table, const string &ns) {
+        if (!ns.empty()) {
+            auto it = table.namespaces.find(ns);
+            return it == table.namespaces.end() ? 0 : it->second.ids.size();
+        }
+        size_t n = table.records.size();
+        for (auto &[name, part] : table.namespaces) n -= part.ids.size();
+        return n;
+    }
+
+    vector<string> queryEmbedding(const string &tableName, const vector<float> &embedding, int topK=3,
+                                  const QueryOptions &opts = {}, SearchStats *stats = nullptr) const {
+        auto profile = opts.profile;
+        if (profile && !stats) stats = &profile->search;
+        shared_lock<shared_mutex> lock(dbMutex);
+        if (profile) profile->stage("lock");
+        if (tables.find(tableName) == tables.end()) return {};
+        const auto &table = tables.at(tableName);
+        if (embedding.size() != (size_t)table.dim) return {};
+        auto qv = prepareQuery(table, embedding);
+        int fetch = fetchCount(topK, opts);
+        auto hits = searchHits(tableName, table, qv, fetch, opts, stats);
+        if (profile) {
+            profile->plan["mode"] = opts.mode;
+            profile->plan["fetch"] = fetch;
+            profile->plan["candidates"] = hits.size();
+            if (!opts.ns.empty()) profile->plan["namespace"] = opts.ns;
+            profile->stage("search");
+        }
+        auto ids = rankedIDs(table, hits, topK, opts);
+        if (profile) {
+            if (opts.mmrLambda < 1) profile->plan["mmrLambda"] = opts.mmrLambda;
+            profile->stage("rank");
+        }
+        return ids;
+    }
+
+    // One result list per embedding, each searched on its own under one table lock. A profile
+    // sums the search stats of all queries.
+    vector<vector<string>> queryEmbeddingBatch(const string &tableName, const vector<vector<float>> &embeddings,
+                                               int topK=3, const QueryOptions &opts = {}) const {
+        auto profile = opts.profile;
+        vector<vector<string>> result(embeddings.size());
+        shared_lock<shared_mutex> lock(dbMutex);
+        if (profile) profile->stage("lock");
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) return result;
+        const auto &table = tIt->second;
+        int fetch = fetchCount(topK, opts);
+        vector<vector<pair<float,size_t>>> hits(embeddings.size());
+        size_t searched = 0, candidates = 0;
+        for (size_t i = 0; i < embeddings.size(); i++) {
+            if (embeddings[i].size() != (size_t)table.dim) continue;
+            hits[i] = searchHits(tableName, table, prepareQuery(table, embeddings[i]), fetch, opts,
+                                 profile ? &profile->search : nullptr);
+            searched++;
+            candidates += hits[i].size();
+        }
+        if (profile) {
+            profile->plan["mode"] = opts.mode;
+            profile->plan["queries"] = searched;
+            profile->plan["fetch"] = fetch;
+            profile->plan["candidates"] = candidates;
+            if (!opts.ns.empty()) profile->plan["namespace"] = opts.ns;
+            profile->stage("search");
+        }
+        for (size_t i = 0; i < embeddings.size(); i++)
+            if (!hits[i].empty()) result[i] = rankedIDs(table, hits[i], topK, opts);
+        if (profile) {
+            if (opts.mmrLambda < 1) profile->plan["mmrLambda"] = opts.mmrLambda;
+            profile->stage("rank");
+        }
+        return result;
+    }
+
+    vector<string> queryHybrid(const string &tableName,
+                               const string &field, const string &value,
+                               const vector<float> &embedding, int topK=3,
+                               const QueryOptions &opts = {}) const {
+        auto profile = opts.profile;
+        auto filteredIDs = queryField(tableName, field, value, opts.ns, profile);
+        if (profile) profile->plan["strategy"] = "filter, then intersect with " + to_string(topK * 10) + " nearest";
+        if (filteredIDs.empty()) return {};
+
+        // Diversifying the unfiltered pool would drop matches; rank by relevance only
+        QueryOptions relevance = opts;
+        relevance.mmrLambda = 1;
+        auto candidateIDs = queryEmbedding(tableName, embedding, topK*10, relevance);
+        unordered_set<string> filterSet(filteredIDs.begin(), filteredIDs.end());
+        if (profile) profile->stage("filterSet");
+
+        vector<string> final;
+        for (auto &id : candidateIDs)
+            if (filterSet.count(id)) final.push_back(id);
+        if (final.size() > (size_t)topK) final.resize(topK);
+        if (profile) {
+            profile->plan["intersected"] = final.size();
+            profile->stage("intersect");
+        }
+        return final;
+    }
+
+    // Up to perGroup nearest records for each of the `groups` best values of a field. HNSW
+    // indices group during traversal; other modes group an over-fetched candidate list.
+    json queryGrouped(const string &tableName, const vector<float> &embedding, const string &groupBy,
+                      int groups, int perGroup, const QueryOptions &opts = {}, SearchStats *stats = nullptr) const {
+        if (groups < 1 || perGroup < 1) throw runtime_error("groups and perGroup must be positive");
+        auto profile = opts.profile;
+        if (profile && !stats) stats = &profile->search;
+        shared_lock<shared_mutex> lock(dbMutex);
+        if (profile) profile->stage("lock");
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) return json::array();
+        const auto &table = tIt->second;
+        if (embedding.size() != (size_t)table.dim) return json::array();
+
+        unordered_map<string,long> keys;
+        vector<string> names;
+        GroupedResults grouped([&](size_t label) -> long {
+            auto idIt = table.labelToID.find(label);
+            if (idIt == table.labelToID.end()) return -1;
+            auto &fields = table.records.at(idIt->second).fields;
+            auto fIt = fields.find(groupBy);
+            if (fIt == fields.end()) return -1;
+            auto [kIt, inserted] = keys.emplace(fIt->second, (long)names.size());
+            if (inserted) names.push_back(fIt->second);
+            return kIt->second;
+        }, groups, perGroup);
+
+        auto qv = prepareQuery(table, embedding);
+        int fetch = groups * perGroup;
+        auto graph = opts.mode == "hnsw" ? dynamic_cast<const HnswIndex*>(vectorIndex(table, opts.ns)) : nullptr;
+        vector<pair<float,size_t>> hits;
+        if (graph) {
+            searchGraph(*graph, static_cast<const VectorSpace&>(*table.space), qv.data(), fetch,
+                        searchParams(table, opts), nullptr, stats, &grouped);
+            addDiskHits(table, qv, fetch * 4, opts, hits);
+        } else {
+            hits = searchHits(tableName, table, qv, fetch * 10, opts, stats);
+        }
+        for (auto &[dist, label] : hits) grouped.admit(dist, label);
+        if (profile) {
+            profile->plan["mode"] = opts.mode;
+            profile->plan["groupBy"] = groupBy;
+            profile->plan["strategy"] = graph ? "grouped graph search" : "search " + to_string(fetch * 10) + ", then group";
+            if (!opts.ns.empty()) profile->plan["namespace"] = opts.ns;
+            profile->stage("search");
+        }
+
+        json result = json::array();
+        for (auto &[key, members] : grouped.ranked()) {
+            json entries = json::array();
+            for (auto &[dist, label] : members)
+                entries.push_back({{"id", table.labelToID.at(label)}, {"distance", dist}});
+            result.push_back({{"group", names[key]}, {"hits", entries}});
+        }
+        if (profile) {
+            profile->plan["groups"] = result.size();
+            profile->stage("group");
+        }
+        return result;
+    }
+
+    // --- Graph relationships ---
+    // Adds or removes one validated edge; the caller holds dbMutex exclusively. An end merged
+    // away by dedup earlier in the write leaves it unchanged. Returns whether the edge changed.
+    bool updateEdge(const WriteOp &op, uint64_t seq) {
+        auto &table = tables.at(op.tableName);
+        auto fIt = table.records.find(op.recordID), toIt = table.records.find(op.target);
+        if (fIt == table.records.end() || toIt == table.records.end()) return false;
+        uint32_t type = table.edges.typeId(op.edgeType);
+        bool add = op.kind == WriteOp::AddEdge;
+        bool changed = add ? table.edges.add(fIt->second.label, toIt->second.label, type)
+                           : table.edges.remove(fIt->second.label, toIt->second.label, type);
+        if (changed)
+            capturedChanges.push_back({{"seq", seq}, {"op", add ? "add_edge" : "remove_edge"}, {"table", op.tableName},
+                                       {"id", op.recordID}, {"type", op.edgeType}, {"to", op.target}});
+        return changed;
+    }
+
+    // Neighbors of `label` that pass the filter: (neighbor, edge type, incoming)
+    vector<tuple<size_t,uint32_t,bool>> neighborLabels(const Table &table, size_t label, const EdgeFilter &filter) const {
+        vector<tuple<size_t,uint32_t,bool>> out;
+        vector<uint32_t> types;
+        for (auto &name : filter.types) {
+            auto it = table.edges.types.find(name);
+            if (it != table.edges.types.end()) types.push_back(it->second);
+        }
+        if (!filter.types.empty() && types.empty()) return out;
+        for (bool incoming : {false, true}) {
+            if (filter.direction != "both" && incoming != (filter.direction == "in")) continue;
+            for (auto &e : table.edges.edges(label, incoming)) {
+                if (!types.empty() && find(types.begin(), types.end(), e.type) == types.end()) continue;
+                auto idIt = table.labelToID.find(e.node);
+                if (idIt == table.labelToID.end()) continue;
+                if (!filter.field.empty()) {
+                    auto &fields = table.records.at(idIt->second).fields;
+                    auto fIt = fields.find(filter.field);
+                    if (fIt == fields.end() || fIt->second != filter.value) continue;
+                }
+                out.emplace_back(e.node, e.type, incoming);
+            }
+        }
+        return out;
+    }
+
+    // Breadth-first expansion up to `hops` edges from the start labels (depth 0).
+    // Returns (label, depth) in visit order, at most `limit` entries.
+    vector<pair<size_t,int>> expandLabels(const Table &table, const vector<size_t> &start, int hops,
+                                          const EdgeFilter &filter, size_t limit) const {
+        if (filter.direction != "out" && filter.direction != "in" && filter.direction != "both")
+            throw runtime_error("direction must be out, in or both");
+        vector<pair<size_t,int>> visited;
+        unordered_set<size_t> seen;
+        for (auto label : start)
+            if (visited.size() < limit && seen.insert(label).second) visited.push_back({label, 0});
+        for (size_t i = 0; i < visited.size() && visited.size() < limit; i++) {
+            auto [label, depth] = visited[i];
+            if (depth >= hops) continue;
+            for (auto &[next, type, incoming] : neighborLabels(table, label, filter)) {
+                if (!seen.insert(next).second) continue;
+                visited.push_back({next, depth + 1});
+                if (visited.size() == limit) break;
+            }
+        }
+        return visited;
+    }
+
+    json neighbors(const string &tableName, const string &recordID, const EdgeFilter &filter) const {
+        shared_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) throw runtime_error("unknown table " + tableName);
+        auto &table = tIt->second;
+        auto recIt = table.records.find(recordID);
+        if (recIt == table.records.end()) throw runtime_error("unknown record " + recordID);
+        json out = json::array();
+        for (auto &[label, type, incoming] : neighborLabels(table, recIt->second.label, filter))
+            out.push_back({{"id", table.labelToID.at(label)}, {"type", table.edges.typeNames[type]},
+                           {"direction", incoming ? "in" : "out"}});
+        return out;
+    }
+
+    json traverse(const string &tableName, const vector<string> &startIDs, int hops, const EdgeFilter &filter,
+                  size_t limit) const {
+        shared_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) throw runtime_error("unknown table " + tableName);
+        auto &table = tIt->second;
+        vector<size_t> start;
+        for (auto &id : startIDs) {
+            auto recIt = table.records.find(id);
+            if (recIt != table.records.end()) start.push_back(recIt->second.label);
+        }
+        json out = json::array();
+        for (auto &[label, depth] : expandLabels(table, start, hops, filter, limit))
+            out.push_back({{"id", table.labelToID.at(label)}, {"depth", depth}});
+        return out;
+    }
+
+    // Vector search, then `hops` edge expansions from the hits in the same read lock
+    json queryExpand(const string &tableName, const vector<float> &embedding, int topK, int hops,
+                     const EdgeFilter &filter, size_t limit, const QueryOptions &opts = {}) const {
+        auto profile = opts.profile;
+        shared_lock<shared_mutex> lock(dbMutex);
+        if (profile) profile->stage("lock");
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) return {{"hits", json::array()}, {"expanded", json::array()}};
+        const auto &table = tIt->second;
+        if (embedding.size() != (size_t)table.dim) throw runtime_error("embedding has the wrong dimension");
+        int fetch = fetchCount(topK, opts);
+        auto hits = searchHits(tableName, table, prepareQuery(table, embedding), fetch, opts,
+                               profile ? &profile->search : nullptr);
+        auto ids = rankedIDs(table, hits, topK, opts);
+        if (profile) {
+            profile->plan["mode"] = opts.mode;
+            profile->plan["fetch"] = fetch;
+            profile->plan["candidates"] = hits.size();
+            profile->stage("search");
+        }
+        vector<size_t> start;
+        for (auto &id : ids) start.push_back(table.records.at(id).label);
+        json expanded = json::array();
+        for (auto &[label, depth] : expandLabels(table, start, hops, filter, limit + start.size()))
+            if (depth > 0) expanded.push_back({{"id", table.labelToID.at(label)}, {"depth", depth}});
+        if (profile) {
+            profile->plan["hops"] = hops;
+            profile->plan["expanded"] = expanded.size();
+            profile->stage("expand");
+        }
+        return {{"hits", ids}, {"expanded", expanded}};
+    }
+
+    json configureTable(const string &tableName, const json &patch) {
+        unique_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        TableConfig next = tIt == tables.end() ? TableConfig{} : tIt->second.config;
+        json changes = patch;
+        changes.erase("efTunedRecords"); // tuner bookkeeping, written only by tuneEf
+        changes.erase("efRecall");
+        from_json(changes, next);
+        createTable(tableName);
+        auto &table = tables[tableName];
+        if (next.precision != table.config.precision || next.metric != table.config.metric) {
+            // Index layout depends on both; only switch before the first write
+            if (!table.records.empty())
+                throw runtime_error("precision and metric can only be changed on an empty table");
+            table.index.reset();
+            table.namespaces.clear();
+            table.space = table.dim > 0 ? makeSpace(next, table.dim) : nullptr;
+        }
+        bool repack = next.precision != table.config.precision || next.metric != table.config.metric;
+        bool rebuild = next.binaryQuantization != table.config.binaryQuantization;
+        if (next.recallTarget != table.config.recallTarget || next.recallK != table.config.recallK)
+            next.efTunedRecords = 0; // tune again at the next check
+        table.config = next;
+        if (repack && table.space) repackSubscriptions(tableName, table);
+        if (rebuild) rebuildBinaryCodes(table);
+        saveMeta(tableName);
+        return table.config;
+    }
+
+    json tableConfig(const string &tableName) const {
+        shared_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) return TableConfig{};
+        json j = tIt->second.config;
+        if (tIt->second.space) j["kernel"] = static_cast<VectorSpace&>(*tIt->second.space).kernelName();
+        return j;
+    }
+
+    // Moves the default namespace into an SSD-resident graph index and drops the in-memory
+    // copy of every vector it serves; the HNSW is replaced by a delta holding only records
+    // rewritten during the build, which keep their vectors in memory
+    json buildDiskIndex(const string &tableName, const DiskGraphIndex::Params &params) {
+        {
+            lock_guard<mutex> lock(diskBuildsMutex);
+            if (!diskBuilds.insert(tableName).second)
+                throw runtime_error("disk index build already running for " + tableName);
+        }
+        struct BuildSlot {
+            MidDB &db; const string &name;
+            ~BuildSlot() { lock_guard<mutex> lock(db.diskBuildsMutex); db.diskBuilds.erase(name); }
+        } slot{*this, tableName};
+
+        vector<float> data;
+        vector<size_t> labels;
+        vector<uint64_t> seqs; // version each row was copied from
+        size_t dim;
+        {
+            shared_lock<shared_mutex> lock(dbMutex);
+            auto tIt = tables.find(tableName);
+            if (tIt == tables.end() || tIt->second.dim == 0) throw runtime_error("unknown table " + tableName);
+            if (tIt->second.config.metric == Metric::IP)
+                throw runtime_error("disk index requires an l2 or cosine table");
+            dim = tIt->second.dim;
+            for (auto &[id, rec] : tIt->second.records) {
+                if (!rec.ns.empty()) continue;
+                labels.push_back(rec.label);
+                seqs.push_back(rec.seq);
+                auto embedding = embeddingOf(tIt->second, rec);
+                data.insert(data.end(), embedding.begin(), embedding.end());
+            }
+        }
+        auto start = chrono::steady_clock::now();
+        DiskGraphIndex::build(diskFile(tableName), data, labels, dim, params);
+        auto disk = make_unique<DiskGraphIndex>(diskFile(tableName));
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        vector<float>().swap(data);
+
+        unique_lock<shared_mutex> lock(dbMutex);
+        auto &table = tables[tableName];
+        unordered_map<size_t,size_t> row;
+        for (size_t i = 0; i < labels.size(); i++) row[labels[i]] = i;
+        auto delta = make_unique<hnswlib::HierarchicalNSW<float>>(table.space.get(), 20000);
+        size_t evicted = 0;
+        for (auto &[id, rec] : table.records) {
+            if (!rec.ns.empty()) continue;
+            auto r = row.find(rec.label);
+            if (r != row.end() && rec.seq == seqs[r->second]) {
+                evictEmbedding(rec);
+                evicted++;
+                continue;
+            }
+            loadEmbedding(table, rec); // still on the previous disk index
+            reserveIndex(*delta);
+            delta->addPoint(storedData(table, rec), rec.label);
+        }
+        table.index = std::move(delta);
+        table.disk = std::move(disk);
+        saveIndex(tableName);
+        saveTable(tableName); // the snapshot drops the evicted vectors too
+
+        cout << "[INFO] Built disk index for " << tableName << " (" << labels.size() << " vectors, " << seconds << "s)\n";
+        return {{"records", labels.size()}, {"seconds", seconds},
+                {"memoryBytes", table.disk->memoryBytes()}, {"fileBytes", fs::file_size(diskFile(tableName))},
+                {"diskResident", evicted}, {"delta", table.index->getCurrentElementCount()}};
+    }
+
+    // Renumbers the table's HNSW nodes for locality and checkpoints the default index
+    json reorderTable(const string &tableName) {
+        unique_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) throw runtime_error("unknown table " + tableName);
+        auto &table = tIt->second;
+        double before = sampleQueryMicros(table);
+        auto start = chrono::steady_clock::now();
+        reorderIndices(table);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double after = sampleQueryMicros(table);
+        saveIndex(tableName);
+        cout << "[INFO] Reordered " << table.reorderedNodes << " graph nodes of " << tableName << " (" << seconds << "s)\n";
+        return {{"nodes", table.reorderedNodes}, {"seconds", seconds},
+                {"queryMicrosBefore", before}, {"queryMicrosAfter", after}};
+    }
+
+    // Held-out records of the default namespace are searched (excluding themselves) at a grid
+    // of ef values and compared with brute-force neighbors; the smallest ef meeting the
+    // table's recallTarget is stored in its config. The lock is taken per sample so writes
+    // interleave with a long run.
+    json tuneEf(const string &tableName) {
+        static const vector<size_t> grid = {10, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+        vector<string> sample;
+        double target;
+        size_t k, records;
+        {
+            shared_lock<shared_mutex> lock(dbMutex);
+            auto tIt = tables.find(tableName);
+            if (tIt == tables.end()) throw runtime_error("unknown table " + tableName);
+            auto &table = tIt->second;
+            if (table.config.recallTarget <= 0) throw runtime_error("no recallTarget set for table " + tableName);
+            if (!table.index || table.disk) throw runtime_error("ef tuning needs an in-memory HNSW default namespace");
+            target = table.config.recallTarget;
+            k = table.config.recallK;
+            records = defaultRecords(table);
+            for (auto &[id, rec] : table.records)
+                if (rec.ns.empty()) sample.push_back(id);
+            mt19937 rng(records);
+            shuffle(sample.begin(), sample.end(), rng);
+            if (sample.size() > TUNE_SAMPLES) sample.resize(TUNE_SAMPLES);
+        }
+
+        auto start = chrono::steady_clock::now();
+        vector<size_t> found(grid.size());
+        size_t expected = 0;
+        for (auto &id : sample) {
+            shared_lock<shared_mutex> lock(dbMutex);
+            auto tIt = tables.find(tableName);
+            if (tIt == tables.end() || !tIt->second.index || tIt->second.disk) break;
+            auto &table = tIt->second;
+            auto recIt = table.records.find(id);
+            if (recIt == table.records.end() || !recIt->second.ns.empty()) continue;
+            const void *query = storedData(table, recIt->second);
+            auto distance = table.space->get_dist_func();
+            void *param = table.space->get_dist_func_param();
+            vector<pair<float,size_t>> exact;
+            for (auto &[otherID, other] : table.records)
+                if (other.ns.empty() && other.label != recIt->second.label)
+                    exact.emplace_back(distance(query, storedData(table, other), param), other.label);
+            size_t kk = min(k, exact.size());
+            partial_sort(exact.begin(), exact.begin() + kk, exact.end());
+            unordered_set<size_t> truth;
+            for (size_t i = 0; i < kk; i++) truth.insert(exact[i].second);
+            expected += kk;
+            ExcludeLabel self(recIt->second.label);
+            auto &space = static_cast<const VectorSpace&>(*table.space);
+            for (size_t g = 0; g < grid.size(); g++)
+                for (auto &[dist, label] : searchGraph(*table.index, space, query, k, {grid[g]}, &self))
+                    found[g] += truth.count(label);
+        }
+        if (!expected) throw runtime_error("no held-out records to tune " + tableName);
+
+        json curve = json::array();
+        size_t best = grid.size();
+        for (size_t g = 0; g < grid.size(); g++) {
+            double recall = double(found[g]) / expected;
+            curve.push_back({{"ef", grid[g]}, {"recall", recall}});
+            if (recall >= target && best == grid.size()) best = g;
+        }
+        if (best == grid.size()) best = grid.size() - 1;
+        double recall = double(found[best]) / expected;
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        unique_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) throw runtime_error("unknown table " + tableName);
+        auto &config = tIt->second.config;
+        config.ef = grid[best];
+        config.efTunedRecords = records;
+        config.efRecall = recall;
+        saveMeta(tableName);
+        cout << "[INFO] Tuned " << tableName << ": ef=" << config.ef << " recall@" << k << "=" << recall
+             << (recall < target ? " (below target)" : "") << " over " << sample.size() << " samples\n";
+        return {{"ef", config.ef}, {"recall", recall}, {"target", target}, {"k", k},
+                {"samples", sample.size()}, {"seconds", seconds}, {"curve", curve}};
+    }
+
+    // --- Background jobs ---
+    static constexpr size_t MAX_FINISHED_JOBS = 100;  // older finished jobs are dropped from /jobs
+
+    // Joins finished runners and drops the oldest finished jobs beyond MAX_FINISHED_JOBS; the
+    // caller holds jobsMutex. A runner sets its state as its last step, so the joins are short.
+    void reapJobs() {
+        size_t finished = 0;
+        for (auto &[id, job] : jobs)
+            if (job->state != "running") {
+                if (job->runner.joinable()) job->runner.join();
+                finished++;
+            }
+        for (auto it = jobs.begin(); it != jobs.end() && finished > MAX_FINISHED_JOBS;)
+            if (it->second->state != "running") { it = jobs.erase(it); finished--; }
+            else ++it;
+    }
+
+    // Runs body on its own thread; a traced request gets a "job.<kind>" span for the run
+    string startJob(const string &kind, const string &tableName, function<json(Job&)> body,
+                    const Tracer::Span &trace = {}) {
+        auto job = make_shared<Job>();
+        job->kind = kind;
+        job->table = tableName;
+        {
+            lock_guard<mutex> lock(jobsMutex);
+            reapJobs();
+            job->id = to_string(nextJob++);
+            jobs[stoul(job->id)] = job;
+        }
+        job->runner = thread([this, job, body, span = Tracer::child(trace, "job." + kind)]() mutable {
+            string state = "done", error;
+            json result;
+            try { result = body(*job); }
+            catch (exception &e) { state = "failed"; error = e.what(); }
+            if (state == "done" && job->cancel) state = "cancelled";
+            span.args = {{"job", job->id}, {"state", state}};
+            tracer.end(span);
+            lock_guard<mutex> lock(jobsMutex);
+            job->state = state;
+            job->finished = chrono::steady_clock::now();
+            job->error = error;
+            job->result = result;
+            cout << "[INFO] Job " << job->id << " (" << job->kind << " " << job->table << ") " << state
+                 << (error.empty() ? "" : ": " + error) << "\n";
+        });
+        return job->id;
+    }
+
+    static json jobJson(const Job &job) {
+        json j = {{"id", job.id}, {"kind", job.kind}, {"table", job.table}, {"state", job.state},
+                  {"done", job.done.load()}, {"total", job.total.load()},
+                  {"seconds", chrono::duration<double>((job.state == "running" ? chrono::steady_clock::now()
+                                                                                  : job.finished) - job.started).count()}};
+        if (!job.error.empty()) j["error"] = job.error;
+        if (!job.result.is_null()) j["result"] = job.result;
+        return j;
+    }
+
+    shared_ptr<Job> findJob(const string &id) const {
+        auto it = jobs.find(strtoul(id.c_str(), nullptr, 10));
+        if (it == jobs.end()) throw runtime_error("unknown job " + id);
+        return it->second;
+    }
+
+    json jobStatus(const string &id) const {
+        lock_guard<mutex> lock(jobsMutex);
+        return jobJson(*findJob(id));
+    }
+
+    json listJobs() const {
+        lock_guard<mutex> lock(jobsMutex);
+        json j = json::array();
+        for (auto &[id, job] : jobs) j.push_back(jobJson(*job));
+        return j;
+    }
+
+    json cancelJob(const string &id) {
+        lock_guard<mutex> lock(jobsMutex);
+        auto job = findJob(id);
+        job->cancel = true;
+        return jobJson(*job);
+    }
+
+    // --- Live subscriptions ---
+    // Registers a standing query: later inserts and updates of the table's namespace within
+    // maxDistance (table metric) of the embedding are queued for the subscriber
+    size_t subscribe(const string &tableName, const vector<float> &embedding, float maxDistance, const string &ns) {
+        shared_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end() || !tIt->second.space) throw runtime_error("unknown table " + tableName);
+        auto &table = tIt->second;
+        if (embedding.size() != (size_t)table.dim)
+            throw runtime_error("embedding has " + to_string(embedding.size()) + " dims, table expects " + to_string(table.dim));
+        if (maxDistance < 0) throw runtime_error("maxDistance must not be negative");
+        auto sub = make_shared<Subscription>();
+        sub->table = tableName;
+        sub->ns = ns;
+        sub->maxDistance = maxDistance;
+        sub->embedding = embedding;
+        sub->query = prepareQuery(table, embedding);
+        lock_guard<mutex> subsLock(subsMutex);
+        sub->id = nextSubscription++;
+        subscriptions[sub->id] = sub;
+        auto &matrix = subsByTable[tableName];
+        matrix.subs.push_back(sub);
+        matrix.rows.push_back(sub->query.data());
+        return sub->id;
+    }
+
+    json cancelSubscription(size_t id) {
+        {
+            lock_guard<mutex> lock(subsMutex);
+            auto sub = findSubscription(id);
+            sub->cancelled = true;
+            subscriptions.erase(id);
+            auto &matrix = subsByTable[sub->table];
+            auto pos = find(matrix.subs.begin(), matrix.subs.end(), sub) - matrix.subs.begin();
+            matrix.subs.erase(matrix.subs.begin() + pos);
+            matrix.rows.erase(matrix.rows.begin() + pos);
+        }
+        subsCv.notify_all();
+        return {{"id", id}, {"cancelled", true}};
+    }
+
+    // Takes up to limit queued matches, waiting up to timeout for the first one
+    vector<json> subscriptionMatches(size_t id, size_t limit, chrono::milliseconds timeout) {
+        unique_lock<mutex> lock(subsMutex);
+        auto sub = findSubscription(id);
+        subsCv.wait_for(lock, timeout, [&] { return !sub->matches.empty() || sub->cancelled; });
+        if (sub->cancelled) throw runtime_error("subscription " + to_string(id) + " was cancelled");
+        vector<json> out;
+        while (!sub->matches.empty() && out.size() < limit) {
+            out.push_back(std::move(sub->matches.front()));
+            sub->matches.pop_front();
+        }
+        return out;
+    }
+
+    json listSubscriptions() const {
+        lock_guard<mutex> lock(subsMutex);
+        json j = json::array();
+        for (auto &[id, sub] : subscriptions) j.push_back(subscriptionJson(*sub));
+        return j;
+    }
+
+    // --- kNN graph ---
+    // k nearest neighbors of every record of `tableName`, written as JSON lines to
+    // data/<table>[.<target>].knn.jsonl. Without a target table each record searches its own
+    // namespace, and on HNSW it starts level 0 at its own node, so its link list seeds the
+    // beam and the upper-level descent is skipped. With a target, records are matched against
+    // the target's default namespace. Records are processed in parallel chunks; each chunk
+    // takes the shared lock on its own so inserts keep flowing.
+    string startKnnGraph(const string &tableName, const string &targetName, int k, size_t ef,
+                         const Tracer::Span &trace = {}) {
+        if (k < 1) throw runtime_error("k must be positive");
+        vector<string> ids;
+        {
+            shared_lock<shared_mutex> lock(dbMutex);
+            auto tIt = tables.find(tableName);
+            if (tIt == tables.end()) throw runtime_error("unknown table " + tableName);
+            if (!targetName.empty()) {
+                auto oIt = tables.find(targetName);
+                if (oIt == tables.end()) throw runtime_error("unknown table " + targetName);
+                if (oIt->second.dim != tIt->second.dim) throw runtime_error("tables have different dimensions");
+            }
+            for (auto &[id, rec] : tIt->second.records) ids.push_back(id);
+        }
+        string path = storageDir + "/" + tableName + (targetName.empty() ? "" : "." + targetName) + ".knn.jsonl";
+        return startJob("knn", tableName, [this, tableName, targetName, k, ef, path, ids](Job &job) {
+            job.total = ids.size();
+            ofstream out(path + ".tmp"); // replaces `path` only once complete
+            if (!out) throw runtime_error("cannot write " + path);
+            mutex outMutex;
+            const size_t chunk = 256;
+            size_t chunks = (ids.size() + chunk - 1) / chunk;
+            atomic<size_t> edges{0};
+            atomic<bool> missing{false}; // a table went away: the job fails
+            parallelFor(chunks, [&](size_t cb, size_t ce) {
+                for (size_t c = cb; c < ce && !job.cancel && !missing; c++) {
+                    string lines;
+                    {
+                        shared_lock<shared_mutex> lock(dbMutex);
+                        auto tIt = tables.find(tableName);
+                        auto oIt = tables.find(targetName.empty() ? tableName : targetName);
+                        if (tIt == tables.end() || oIt == tables.end()) { missing = true; return; }
+                        for (size_t i = c * chunk; i < min(ids.size(), (c + 1) * chunk); i++) {
+                            auto recIt = tIt->second.records.find(ids[i]);
+                            if (recIt == tIt->second.records.end()) continue;
+                            auto neighbors = recordNeighbors(tIt->second, recIt->second, oIt->second,
+                                                             targetName.empty(), k, ef);
+                            json line = {{"id", ids[i]}, {"neighbors", json::array()}};
+                            for (auto &[dist, id] : neighbors)
+                                line["neighbors"].push_back({{"id", id}, {"distance", dist}});
+                            edges += neighbors.size();
+                            lines += line.dump() + "\n";
+                        }
+                    }
+                    lock_guard<mutex> lock(outMutex);
+                    out << lines;
+                    job.done += min(ids.size(), (c + 1) * chunk) - c * chunk;
+                }
+            });
+            out.close();
+            if (job.cancel || missing) {
+                fs::remove(path + ".tmp");
+                if (missing) throw runtime_error("table " + tableName + (targetName.empty() ? "" : " or " + targetName) + " was removed");
+                return json();
+            }
+            fs::rename(path + ".tmp", path);
+            return json{{"path", path}, {"records", job.done.load()}, {"edges", edges.load()}, {"k", k}};
+        }, trace);
+    }
+
+    // (distance, id) of the k nearest records to `rec` in `target`; the caller holds dbMutex
+    vector<pair<float,string>> recordNeighbors(const Table &table, const Record &rec, const Table &target,
+                                               bool self, int k, size_t ef) const {
+        QueryOptions opts;
+        opts.ns = self ? rec.ns : "";
+        opts.search.ef = ef;
+        auto qv = prepareQuery(target, embeddingOf(table, rec));
+        vector<pair<float,size_t>> hits;
+        auto graph = dynamic_cast<const HnswIndex*>(vectorIndex(target, opts.ns));
+        if (graph && self && !(opts.ns.empty() && target.disk)) {
+            SearchParams params = searchParams(target, opts);
+            auto node = graph->label_lookup_.find(rec.label);
+            if (node != graph->label_lookup_.end()) params.entry = node->second;
+            ExcludeLabel exclude(rec.label);
+            hits = searchGraph(*graph, static_cast<const VectorSpace&>(*target.space), qv.data(), k, params, &exclude);
+        } else {
+            hits = searchHits("", target, qv, k + self, opts);
+            sort(hits.begin(), hits.end());
+        }
+        vector<pair<float,string>> out;
+        for (auto &[dist, label] : hits) {
+            if (self && label == rec.label) continue;
+            auto it = target.labelToID.find(label);
+            if (it != target.labelToID.end()) out.push_back({dist, it->second});
+            if (out.size() == (size_t)k) break;
+        }
+        return out;
+    }
+
+    // --- Clustering ---
+    // Mini-batch k-means (k-means++ seeding on a sample) over one namespace's embeddings, run on
+    // a copy taken under the shared lock. Assignments are computed in parallel, k centers per
+    // batched distance call, then written back as a field of every record so the field index
+    // can filter on them. Cosine tables cluster their unit vectors.
+    string startCluster(const string &tableName, const string &ns, int k, int iterations, int batchSize,
+                        const string &field, const Tracer::Span &trace = {}) {
+        if (k < 1 || iterations < 0 || batchSize < 1) throw runtime_error("k and batchSize must be positive");
+        if (field.empty()) throw runtime_error("field must not be empty");
+        auto ids = make_shared<vector<string>>();
+        auto data = make_shared<vector<float>>();
+        size_t dim;
+        {
+            shared_lock<shared_mutex> lock(dbMutex);
+            auto tIt = tables.find(tableName);
+            if (tIt == tables.end()) throw runtime_error("unknown table " + tableName);
+            auto &table = tIt->second;
+            dim = table.dim;
+            for (auto &[id, rec] : table.records) {
+                if (rec.ns != ns) continue;
+                ids->push_back(id);
+                auto v = embeddingOf(table, rec);
+                data->insert(data->end(), v.begin(), v.end());
+            }
+            if (ids->size() < (size_t)k) throw runtime_error("fewer records than clusters");
+        }
+        return startJob("cluster", tableName, [this, tableName, ns, k, iterations, batchSize, field, ids, data, dim](Job &job) {
+            size_t n = ids->size();
+            const float *vecs = data->data();
+            auto vec = [&](size_t i) { return vecs + i * dim; };
+            job.total = iterations + n;
+            VectorSpace space(dim, Metric::L2, Precision::FP32);
+            mt19937 rng(n);
+
+            // k-means++ seeding on up to 64 points per cluster
+            vector<size_t> sample(n);
+            iota(sample.begin(), sample.end(), 0);
+            shuffle(sample.begin(), sample.end(), rng);
+            sample.resize(min(n, max<size_t>(k, 64 * (size_t)k)));
+            vector<float> centers((size_t)k * dim);
+            vector<float> nearest(sample.size(), numeric_limits<float>::max());
+            vector<const void*> ptrs(sample.size());
+            vector<float> dists(sample.size());
+            for (size_t s = 0; s < sample.size(); s++) ptrs[s] = vec(sample[s]);
+            size_t pick = sample[0];
+            for (int c = 0; c < k; c++) {
+                copy_n(vec(pick), dim, &centers[(size_t)c * dim]);
+                space.distances(&centers[(size_t)c * dim], ptrs.data(), sample.size(), dists.data());
+                double total = 0;
+                for (size_t s = 0; s < sample.size(); s++) total += nearest[s] = min(nearest[s], dists[s]);
+                double r = uniform_real_distribution<double>(0, total)(rng);
+                for (size_t s = 0; s < sample.size(); s++)
+                    if ((r -= nearest[s]) <= 0 || s + 1 == sample.size()) { pick = sample[s]; break; }
+            }
+            vector<const void*> centerPtrs(k);
+            for (int c = 0; c < k; c++) centerPtrs[c] = &centers[(size_t)c * dim];
+            auto closest = [&](const float *v, float &dist, vector<float> &scratch) {
+                space.distances(v, centerPtrs.data(), k, scratch.data());
+                size_t best = min_element(scratch.begin(), scratch.end()) - scratch.begin();
+                dist = scratch[best];
+                return best;
+            };
+
+            // Mini-batch updates with a per-center learning rate of 1 / count
+            vector<size_t> counts(k, 0), batch(batchSize), assigned(batchSize);
+            uniform_int_distribution<size_t> any(0, n - 1);
+            for (int it = 0; it < iterations && !job.cancel; it++, job.done++) {
+                for (auto &b : batch) b = any(rng);
+                parallelFor(batch.size(), [&](size_t begin, size_t end) {
+                    vector<float> scratch(k);
+                    float dist;
+                    for (size_t b = begin; b < end; b++) assigned[b] = closest(vec(batch[b]), dist, scratch);
+                });
+                for (size_t b = 0; b < batch.size(); b++) {
+                    float *center = &centers[assigned[b] * dim];
+                    float eta = 1.0f / ++counts[assigned[b]];
+                    const float *v = vec(batch[b]);
+                    for (size_t d = 0; d < dim; d++) center[d] += eta * (v[d] - center[d]);
+                }
+            }
+
+            // Final assignment of every record
+            vector<int> cluster(n);
+            vector<double> inertia(n);
+            parallelFor(n, [&](size_t begin, size_t end) {
+                vector<float> scratch(k);
+                for (size_t i = begin; i < end && !job.cancel; i++, job.done++) {
+                    float dist;
+                    cluster[i] = closest(vec(i), dist, scratch);
+                    inertia[i] = dist;
+                }
+            });
+            if (job.cancel) return json();
+
+            // Assignments are written as field patches through the write queue, so they get
+            // versions, WAL entries and change events like client writes
+            vector<size_t> sizes(k, 0);
+            for (size_t i = 0; i < n; i++) sizes[cluster[i]]++;
+            const size_t chunk = 1000;
+            vector<uint64_t> seqs;
+            for (size_t begin = 0; begin < n && !job.cancel; begin += chunk) {
+                vector<WriteOp> ops;
+                for (size_t i = begin; i < min(n, begin + chunk); i++)
+                    ops.push_back({WriteOp::Patch, tableName, (*ids)[i], {{field, to_string(cluster[i])}}, {}, ns});
+                seqs.push_back(submit(std::move(ops)));
+            }
+            size_t written = 0;
+            for (uint64_t seq : seqs) {
+                json ack;
+                while ((ack = writeAck(seq, chrono::milliseconds(500)))["status"] == "pending")
+                    if (job.cancel) return json();
+                for (auto &op : ack.value("ops", json::array())) written += !op["version"].is_null();
+            }
+            return json{{"k", k}, {"field", field}, {"records", written}, {"sizes", sizes},
+                        {"inertia", accumulate(inertia.begin(), inertia.end(), 0.0)}};
+        }, trace);
+    }
+
+    json listNamespaces(const string &tableName) const {
+        json j = json::object();
+        shared_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) return j;
+        for (auto &[name, part] : tIt->second.namespaces)
+            j[name] = {{"records", part.ids.size()}, {"index", part.graph ? "hnsw" : "flat"}};
+        return j;
+    }
+
+    json tableStats(const string &tableName) const {
+        shared_lock<shared_mutex> lock(dbMutex);
+        auto tIt = tables.find(tableName);
+        if (tIt == tables.end()) throw runtime_error("unknown table " + tableName);
+        auto &table = tIt->second;
+        auto &d = table.dedup;
+        return {{"records", table.records.size()}, {"namespaces", table.namespaces.size()}, {"dim", table.dim},
+                {"dedup", {{"policy", dedupName(table.config.dedup)}, {"checked", d.checked},
+                           {"rejected", d.rejected}, {"merged", d.merged},
+                           {"rate", d.checked ? double(d.rejected + d.merged) / d.checked : 0.0}}}};
+    }
+
+    // The snapshot records the last applied write so WAL replay can skip what it already holds
+    void saveTable(const string &tableName) {
+        auto &table = tables[tableName];
+        json j = json::object();
+        for (auto &[id, rec] : table.records) {
+            j[id]["fields"] = rec.fields;
+            if (rec.onDisk) j[id]["disk"] = true; // the vector is read from the disk index
+            else if (table.config.precision == Precision::FP32) j[id]["embedding"] = rec.embedding;
+            else j[id]["embedding16"] = rec.packed; // raw fp16/bf16 bits
+            j[id]["label"] = rec.label;
+            j[id]["seq"] = rec.seq;
+            if (!rec.ns.empty()) j[id]["namespace"] = rec.ns;
+        }
+        ofstream out(tableFile(tableName));
+        out << json{{"seq", appliedSeq.load()}, {"records", j}}.dump(2);
+        saveEdges(tableName);
+        saveHistory(tableName);
+    }
+
+    // Versions kept by keepVersions survive restarts
+    void saveHistory(const string &tableName) {
+        auto &table = tables[tableName];
+        if (table.history.empty() && !fs::exists(historyFile(tableName))) return;
+        json j = json::object();
+        for (auto &[id, versions] : table.history) {
+            size_t keep = min(versions.size(), table.config.keepVersions);
+            for (size_t i = versions.size() - keep; i < versions.size(); i++) {
+                auto &rec = versions[i].rec;
+                json v = {{"seq", rec.seq}, {"to", versions[i].to}, {"fields", rec.fields}, {"label", rec.label}};
+                if (table.config.precision == Precision::FP32) v["embedding"] = rec.embedding;
+                else v["embedding16"] = rec.packed;
+                if (!rec.ns.empty()) v["namespace"] = rec.ns;
+                j[id].push_back(v);
+            }
+        }
+        ofstream(historyFile(tableName)) << j.dump();
+    }
+
+    // Edges are stored by record ID as [from, type, to] triples
+    void saveEdges(const string &tableName) {
+        auto &table = tables[tableName];
+        if (!table.edges.count && !fs::exists(edgesFile(tableName))) return;
+        json edges = json::array();
+        for (size_t from = 0; from < table.edges.out.size(); from++)
+            for (auto &e : table.edges.out[from])
+                edges.push_back({table.labelToID.at(from), table.edges.typeNames[e.type], table.labelToID.at(e.node)});
+        ofstream(edgesFile(tableName)) << json{{"edges", edges}}.dump();
+    }
+
+    // Only the default namespace index is persisted; namespace indices are rebuilt on load
+    void saveIndex(const string &tableName) {
+        auto &table = tables[tableName];
+        if (table.index) table.index->saveIndex(indexFile(tableName));
+    }
+
+    void loadTable(const string &tableName) {
+        Table t;
+        ifstream meta(metaFile(tableName));
+        if (meta.is_open()) t.config = json::parse(meta).get<TableConfig>();
+
+        json j = json::object();
+        ifstream in(tableFile(tableName));
+        if (in.is_open()) in >> j;
+        if (j.contains("seq") && j["seq"].is_number()) { // else a snapshot without seq: records only
+            t.snapshotSeq = j["seq"].get<uint64_t>();
+            j = j["records"];
+        }
+        if (fs::exists(diskFile(tableName))) {
+            try { t.disk = make_unique<DiskGraphIndex>(diskFile(tableName)); }
+            catch (exception &e) { cerr << "[WARN] " << e.what() << "\n"; }
+        }
+        for (auto &[id, rec] : j.items()) {
+            Record r;
+            r.fields = rec["fields"].get<unordered_map<string,string>>();
+            r.label = rec["label"].get<size_t>();
+            if (rec.value("disk", false)) {
+                if (!t.disk || !t.disk->contains(r.label))
+                    throw runtime_error("record " + id + " of " + tableName + " is missing from its disk index");
+                r.onDisk = true;
+            } else if (rec.contains("embedding16")) r.packed = rec["embedding16"].get<vector<uint16_t>>();
+            else storeEmbedding(t, r, rec["embedding"].get<vector<float>>());
+            r.ns = rec.value("namespace", "");
+            r.seq = rec.value("seq", (uint64_t)0);
+            t.records[id] = r;
+            t.labelToID[r.label] = id;
+            indexFields(t, id, r);
+            if (t.dim==0) t.dim = r.onDisk ? t.disk->dimension() : r.packed.empty() ? r.embedding.size() : r.packed.size();
+            if (r.label >= t.nextLabel) t.nextLabel = r.label+1;
+        }
+        if (t.dim > 0) t.space = makeSpace(t.config, t.dim);
+        if (ifstream(indexFile(tableName)).good() && t.dim>0)
+            t.index.reset(new hnswlib::HierarchicalNSW<float>(t.space.get(), indexFile(tableName)));
+        for (auto &[ns, part] : t.namespaces) loadNamespaceIndex(t, part);
+        rebuildBinaryCodes(t);
+        ifstream historyIn(historyFile(tableName));
+        if (historyIn.is_open()) {
+            json history = json::parse(historyIn);
+            for (auto &[id, versions] : history.items()) {
+                for (auto &v : versions) {
+                    Record r;
+                    r.fields = v["fields"].get<unordered_map<string,string>>();
+                    if (v.contains("embedding16")) r.packed = v["embedding16"].get<vector<uint16_t>>();
+                    else r.embedding = v["embedding"].get<vector<float>>();
+                    r.label = v["label"].get<size_t>();
+                    r.ns = v.value("namespace", "");
+                    r.seq = v["seq"].get<uint64_t>();
+                    t.history[id].push_back({r, v["to"].get<uint64_t>()});
+                }
+            }
+        }
+        ifstream edgesIn(edgesFile(tableName));
+        if (edgesIn.is_open()) {
+            json edges = json::parse(edgesIn);
+            for (auto &e : edges["edges"]) {
+                auto from = t.records.find(e[0].get<string>()), to = t.records.find(e[2].get<string>());
+                if (from != t.records.end() && to != t.records.end())
+                    t.edges.add(from->second.label, to->second.label, t.edges.typeId(e[1].get<string>()));
+            }
+        }
+        tables[tableName] = std::move(t);
+    }
+};
+
+// --- REST API ---
+QueryOptions queryOptions(const json &j) {
+    QueryOptions opts;
+    opts.ns = j.value("namespace", "");
+    opts.mode = j.value("mode", opts.mode);
+    opts.oversample = j.value("oversample", opts.oversample);
+    opts.search.ef = j.value("ef", opts.search.ef);
+    if (j.contains("budget")) {
+        opts.search.maxDistances = j["budget"].value("distances", opts.search.maxDistances);
+        opts.search.maxMicros = j["budget"].value("micros", opts.search.maxMicros);
+    }
+    opts.search.patience = j.value("patience", opts.search.patience);
+    if (j.contains("mmr")) {
+        opts.mmrLambda = j["mmr"].value("lambda", 0.5f);
+        opts.fetchK = j["mmr"].value("fetchK", opts.fetchK);
+        if (opts.mmrLambda < 0 || opts.mmrLambda > 1) throw runtime_error("mmr lambda must be in [0, 1]");
+        if (opts.fetchK < 0) throw runtime_error("mmr fetchK must be positive");
+    }
+    return opts;
+}
+
+EdgeFilter edgeFilter(const json &j) {
+    EdgeFilter filter;
+    if (j.contains("types")) filter.types = j["types"].get<vector<string>>();
+    if (j.contains("type")) filter.types.push_back(j["type"].get<string>());
+    filter.direction = j.value("direction", filter.direction);
+    filter.field = j.value("field", "");
+    filter.value = j.value("value", "");
+    return filter;
+}
+
+// Write acknowledgement; with "wait" (ms) the response carries the write's outcome and a
+// rejected write (failed condition or validation) answers 409
+void writeResponse(MidDB &db, uint64_t seq, const json &j, httplib::Response &res, json ack = {}) {
+    if (j.contains("wait")) ack = db.writeAck(seq, chrono::milliseconds(j["wait"].get<int>()));
+    else ack.update({{"status", "ok"}, {"seq", seq}});
+    if (ack["status"] == "rejected") res.status = 409;
+    res.set_content(ack.dump(), "application/json");
+}
+
+// Root span of a traced request. It ends when the handler returns, on error paths too, with the
+// query stages as child spans and the status of a failed request, and returns its context to
+// the client.
+class RequestSpan {
+public:
+    RequestSpan(MidDB &db, const httplib::Request &req, httplib::Response &res, const string &name)
+        : span(db.tracing().root(req.get_header_value("traceparent"), name)), db(db), res(res) {}
+    RequestSpan(const RequestSpan &) = delete;
+    ~RequestSpan() {
+        if (!span) return;
+        if (profile) db.tracing().stages(span, *profile);
+        if (res.status >= 400) span.args["status"] = res.status;
+        db.tracing().end(span);
+        res.set_header("traceparent", Tracer::traceparent(span));
+    }
+
+    Tracer::Span span;
+    const QueryProfile *profile = nullptr;
+
+private:
+    MidDB &db;
+    httplib::Response &res;
+};
+
+json explainJson(const QueryProfile &profile) {
+    double total = 0;
+    for (auto &s : profile.stages) total += s["micros"].get<double>();
+    return {{"plan", profile.plan}, {"distances", profile.search.distances},
+            {"nodesVisited", profile.search.hops}, {"stages", profile.stages}, {"micros", total}};
+}
+
+// Query result response. A profiled query is serialized first so that the "serialize" stage is
+// part of the breakdown; with explain the response also carries it. The result is wrapped as
+// {key: result} when there is something next to it: explain or the stats of a budgeted search.
+void queryResponse(httplib::Response &res, const json &result, const QueryOptions &opts, bool explain,
+                   const json &stats = nullptr, const string &key = "ids") {
+    string body = result.dump();
+    if (opts.profile) opts.profile->stage("serialize");
+    if (explain || !stats.is_null()) {
+        body = "{\"" + key + "\":" + body;
+        if (!stats.is_null()) body += ",\"stats\":" + stats.dump();
+        if (explain) body += ",\"explain\":" + explainJson(*opts.profile).dump();
+        body += "}";
+    }
+    res.set_content(body, "application/json");
+}
+
+// --- Slow query log ---
+// Queries slower than their endpoint's threshold, plus a random sample of all queries as a
+// baseline, in a ring buffer. Every query runs with a QueryProfile, so entries carry the plan
+// and stage timings. Settings are atomics and each thread caches the endpoint thresholds; the
+// mutex is taken only to record an entry or to change the settings.
+class SlowQueryLog {
+public:
+    // One query from construction to destruction, recorded on destruction if it was slow or
+    // sampled. The handler passes &profile as opts.profile, sets request once the body is
+    // parsed and error if the query failed.
+    class Scope {
+    public:
+        Scope(SlowQueryLog &log, string endpoint, string table)
+            : log(log), endpoint(std::move(endpoint)), table(std::move(table)) {
+            thread_local mt19937 rng(random_device{}());
+            double rate = log.sampleRate.load(memory_order_relaxed);
+            sampled = rate > 0 && uniform_real_distribution<double>(0, 1)(rng) < rate;
+        }
+        Scope(const Scope &) = delete;
+        ~Scope() { log.record(*this); }
+
+        QueryProfile profile;   // its first stage is the parse
+        json request;           // the query; embeddings are left out of the entry
+        string error;
+
+    private:
+        friend class SlowQueryLog;
+        SlowQueryLog &log;
+        string endpoint, table;
+        bool sampled = false;
+    };
+
+    json list(const string &kind, size_t limit) const {
+        lock_guard<mutex> lock(m);
+        json out = json::array();
+        for (auto it = entries.rbegin(); it != entries.rend() && out.size() < limit; ++it)
+            if (kind.empty() || (*it)["kind"] == kind) out.push_back(*it);
+        return {{"entries", out}, {"slow", slowCount}, {"sampled", sampleCount}};
+    }
+
+    json config() const {
+        lock_guard<mutex> lock(m);
+        return {{"thresholdMs", thresholdMs.load()}, {"endpoints", thresholds}, {"sampleRate", sampleRate.load()},
+                {"capacity", capacity}};
+    }
+
+    // Partial update; endpoint thresholds are merged, null removes one
+    json configure(const json &j) {
+        {
+            lock_guard<mutex> lock(m);
+            double rate = j.value("sampleRate", sampleRate.load());
+            if (rate < 0 || rate > 1) throw runtime_error("sampleRate must be between 0 and 1");
+            sampleRate = rate;
+            thresholdMs = j.value("thresholdMs", thresholdMs.load());
+            capacity = max<size_t>(1, j.value("capacity", capacity));
+            if (j.contains("endpoints")) {
+                for (auto &[name, ms] : j["endpoints"].items()) {
+                    if (ms.is_null()) thresholds.erase(name);
+                    else thresholds[name] = ms.get<double>();
+                }
+                thresholdsVersion++;
+            }
+            while (entries.size() > capacity) entries.pop_front();
+        }
+        return config();
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(m);
+        entries.clear();
+        slowCount = sampleCount = 0;
+    }
+
+private:
+    void record(const Scope &query) {
+        double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - query.profile.started).count();
+        bool slow = micros >= threshold(query.endpoint) * 1000;
+        if (!slow && !query.sampled) return;
+        json request = query.request;
+        if (request.is_object()) {
+            request.erase("embedding");
+            request.erase("embeddings");
+        }
+        json entry = {{"kind", slow ? "slow" : "sample"}, {"endpoint", query.endpoint}, {"table", query.table},
+                      {"micros", micros}, {"request", request}, {"explain", explainJson(query.profile)},
+                      {"at", chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count()}};
+        if (!query.error.empty()) entry["error"] = query.error;
+        lock_guard<mutex> lock(m);
+        (slow ? slowCount : sampleCount)++;
+        entries.push_back(std::move(entry));
+        while (entries.size() > capacity) entries.pop_front();
+    }
+
+    // Endpoint threshold in ms from the calling thread's copy, refreshed when the overrides change
+    double threshold(const string &endpoint) const {
+        thread_local struct { const SlowQueryLog *log = nullptr; uint64_t version = 0; map<string,double> thresholds; } cache;
+        uint64_t version = thresholdsVersion.load(memory_order_acquire);
+        if (cache.log != this || cache.version != version) {
+            lock_guard<mutex> lock(m);
+            cache = {this, thresholdsVersion.load(), thresholds};
+        }
+        auto tIt = cache.thresholds.find(endpoint);
+        return tIt != cache.thresholds.end() ? tIt->second : thresholdMs.load(memory_order_relaxed);
+    }
+
+    mutable mutex m;
+    atomic<double> thresholdMs{100};
+    map<string,double> thresholds;  // per endpoint, overrides thresholdMs
+    atomic<uint64_t> thresholdsVersion{1};
+    atomic<double> sampleRate{0.001};
+    size_t capacity = 1000;
+    deque<json> entries;
+    size_t slowCount = 0, sampleCount = 0;
+};
+
+// Search effort of a budgeted query; "budgetUsed" is the fraction of each limit consumed
+json searchStatsJson(const SearchStats &stats, const SearchParams &params) {
+    json j = {{"ef", stats.ef}, {"efAchieved", stats.efAchieved}, {"distances", stats.distances},
+              {"hops", stats.hops}, {"micros", stats.micros}, {"stop", stats.stop}};
+    if (params.maxDistances) j["budgetUsed"]["distances"] = double(stats.distances) / params.maxDistances;
+    if (params.maxMicros) j["budgetUsed"]["micros"] = stats.micros / params.maxMicros;
+    return j;
+}
+
+// --- Benchmark ---
+// `MidDB --bench [records] [dim] [queries]` builds an in-memory HNSW over random vectors and
+// times hnswlib's searchKnn against searchGraph with and without prefetching. Warm runs
+// repeat each query once before timing it; cold runs stream a 256 MB buffer first.
+static int runBenchmark(size_t n, size_t dim, size_t queries) {
+    const size_t k = 10, ef = 64;
+    mt19937 rng(42);
+    normal_distribution<float> gauss;
+    vector<float> data(n * dim), qs(queries * dim);
+    for (auto &v : data) v = gauss(rng);
+    for (auto &v : qs) v = gauss(rng);
+
+    VectorSpace space(dim, Metric::L2, Precision::FP32);
+    hnswlib::HierarchicalNSW<float> index(&space, n);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < n; i++) index.addPoint(&data[i * dim], i);
+    index.setEf(ef);
+    cout << "[BENCH] " << n << " x " << dim << " (" << space.kernelName() << "), built in "
+         << chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s, ef=" << ef << "\n";
+
+    // Exact neighbors for recall@k
+    auto exact = [&](const vector<float> &set) {
+        vector<vector<size_t>> truth(queries);
+        parallelFor(queries, [&](size_t begin, size_t end) {
+            vector<pair<float,size_t>> all(n);
+            for (size_t q = begin; q < end; q++) {
+                for (size_t i = 0; i < n; i++) all[i] = {l2Distance(&set[q * dim], &data[i * dim], dim), i};
+                partial_sort(all.begin(), all.begin() + k, all.end());
+                for (size_t i = 0; i < k; i++) truth[q].push_back(all[i].second);
+            }
+        });
+        return truth;
+    };
+    auto truth = exact(qs);
+
+    vector<char> evict(256 << 20, 1);
+    volatile char sink = 0;
+    auto flush = [&] { char c = 0; for (size_t i = 0; i < evict.size(); i += 64) c += evict[i]; sink = sink + c; };
+
+    struct Variant { const char *name; function<vector<size_t>(const float*)> run; };
+    auto graph = [&](bool prefetch) {
+        return [&, prefetch](const float *q) {
+            vector<size_t> labels;
+            for (auto &[dist, label] : searchGraph(index, space, q, k, {ef, prefetch})) labels.push_back(label);
+            return labels;
+        };
+    };
+    vector<Variant> variants = {
+        {"hnswlib", [&](const float *q) {
+            vector<size_t> labels;
+            for (auto res = index.searchKnn(q, k); !res.empty(); res.pop()) labels.push_back(res.top().second);
+            return labels;
+        }},
+        {"graph", graph(false)},
+        {"graph+prefetch", graph(true)},
+    };
+
+    auto measure = [&](const Variant &variant, bool cold) {
+        vector<double> micros;
+        size_t found = 0;
+        for (size_t q = 0; q < queries; q++) {
+            const float *query = &qs[q * dim];
+            if (cold) flush(); else variant.run(query);
+            auto t0 = chrono::steady_clock::now();
+            auto labels = variant.run(query);
+            micros.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count());
+            for (auto label : labels) found += count(truth[q].begin(), truth[q].end(), label);
+        }
+        sort(micros.begin(), micros.end());
+        cout << "[BENCH] " << (cold ? "cold" : "warm") << " " << variant.name
+             << ": mean " << accumulate(micros.begin(), micros.end(), 0.0) / queries << "us"
+             << ", p50 " << micros[queries / 2] << "us, p99 " << micros[queries * 99 / 100] << "us"
+             << ", recall@" << k << " " << double(found) / (queries * k) << "\n";
+    };
+    for (bool cold : {false, true})
+        for (auto &variant : variants) measure(variant, cold);
+
+    // Early termination: recall and tail latency under a budget
+    auto limited = [&](SearchParams params) {
+        return [&, params](const float *q) {
+            vector<size_t> labels;
+            for (auto &[dist, label] : searchGraph(index, space, q, k, params)) labels.push_back(label);
+            return labels;
+        };
+    };
+    SearchParams distances{ef}, time{ef}, patience{ef};
+    distances.maxDistances = 500;
+    time.maxMicros = 20;
+    patience.patience = 8;
+    for (auto &variant : vector<Variant>{{"budget 500 distances", limited(distances)},
+                                         {"budget 20us", limited(time)}, {"patience 8", limited(patience)}})
+        measure(variant, true);
+
+    // Same index after BFS renumbering
+    start = chrono::steady_clock::now();
+    reorderGraph(index);
+    cout << "[BENCH] reordered in " << chrono::duration<double>(chrono::steady_clock::now() - start).count() << "s\n";
+    Variant reordered{"graph+prefetch (reordered)", graph(true)};
+    for (bool cold : {false, true}) measure(reordered, cold);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && string(argv[1]) == "--bench")
+        return runBenchmark(argc > 2 ? stoul(argv[2]) : 100000, argc > 3 ? stoul(argv[3]) : 128,
+                            argc > 4 ? stoul(argv[4]) : 1000);
+
+    MidDB db;
+    SlowQueryLog slowLog;
+    httplib::Server svr;
+
+    // --- CRUD Endpoints ---
+    svr.Post("/insert", [&db](const httplib::Request &req, httplib::Response &res){
+        RequestSpan trace(db, req, res, "POST /insert");
+        try {
+            auto j = json::parse(req.body);
+            j["op"] = "insert";
+            auto seq = db.submit({j.get<WriteOp>()}, trace.span);
+            writeResponse(db, seq, j, res);
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
+
+    svr.Post("/update", [&db](const httplib::Request &req, httplib::Response &res){
+        RequestSpan trace(db, req, res, "POST /update");
+        try {
+            auto j = json::parse(req.body);
+            j["op"] = "update";
+            auto seq = db.submit({j.get<WriteOp>()}, trace.span);
+            writeResponse(db, seq, j, res);
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
+
+    svr.Post("/delete", [&db](const httplib::Request &req, httplib::Response &res){
+        RequestSpan trace(db, req, res, "POST /delete");
+        try {
+            auto j = json::parse(req.body);
+            j["op"] = "delete";
+            auto seq = db.submit({j.get<WriteOp>()}, trace.span);
+            writeResponse(db, seq, j, res);
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
+
+    svr.Get(R"(/ack/(\d+))", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            int wait = req.has_param("wait") ? stoi(req.get_param_value("wait")) : 0;
+            res.set_content(db.writeAck(stoull(req.matches[1]), chrono::milliseconds(wait)).dump(), "application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
+
+    svr.Get("/changes", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            uint64_t since = req.has_param("since") ? stoull(req.get_param_value("since")) : 0;
+            size_t limit = req.has_param("limit") ? stoul(req.get_param_value("limit")) : 1000;
+            int wait = req.has_param("wait") ? stoi(req.get_param_value("wait")) : 0;
+            auto events = db.changes(since, limit, chrono::milliseconds(wait));
+            uint64_t next = events.empty() ? since : events.back()["seq"].get<uint64_t>();
+            res.set_content(json{{"changes", events}, {"next", next}}.dump(), "application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
+
+    // Server-sent events; resumes after "since" or the Last-Event-ID header
+    svr.Get("/changes/stream", [&db](const httplib::Request &req, httplib::Response &res){
+        auto since = make_shared<uint64_t>(0);
+        try {
+            if (req.has_header("Last-Event-ID")) *since = stoull(req.get_header_value("Last-Event-ID"));
+            else if (req.has_param("since")) *since = stoull(req.get_param_value("since"));
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+            return;
+        }
+        int heartbeat = req.has_param("heartbeat") ? stoi(req.get_param_value("heartbeat")) : 15000;
+        res.set_chunked_content_provider("text/event-stream", [&db, since, heartbeat](size_t, httplib::DataSink &sink){
+            vector<json> events;
+            try {
+                events = db.changes(*since, 100, chrono::milliseconds(heartbeat));
+            } catch (exception &e) {
+                string out = "event: error\ndata: " + json{{"error", e.what()}}.dump() + "\n\n";
+                sink.write(out.data(), out.size());
+                return false;
+            }
+            string out = events.empty() ? ": keepalive\n\n" : "";
+            for (auto &e : events) {
+                *since = e["seq"];
+                out += "id: " + to_string(*since) + "\ndata: " + e.dump() + "\n\n";
+            }
+            return sink.write(out.data(), out.size());
+        });
+    });
+
+    svr.Get(R"(/record/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            res.set_content(db.getRecord(req.matches[1], req.get_param_value("id")).dump(), "application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
+
+    svr.Get(R"(/history/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            res.set_content(db.recordHistory(req.matches[1], req.get_param_value("id")).dump(), "application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
-        table.labelToID[label] = task.recordID;
-
-        // Update structured index
-        for (auto &[key,val] : task.fields)
-            table.fieldIndex[key][val].insert(task.recordID);
+    });
 
-        // Add to HNSW index
-        table.index->addPoint(task.embedding.data(), label);
+    svr.Post("/batch", [&db](const httplib::Request &req, httplib::Response &res){
+        RequestSpan trace(db, req, res, "POST /batch");
+        try {
+            auto j = json::parse(req.body);
+            auto ops = j.at("ops").get<vector<WriteOp>>();
+            auto seq = db.submit(ops, trace.span);
+            writeResponse(db, seq, j, res, {{"ops", ops.size()}});
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
 
-        cout << "[INFO] Inserted/Updated " << task.recordID << " into " << task.tableName << " (label=" << label << ")\n";
-    }
+    // --- Query Endpoints ---
+    svr.Get(R"(/queryField/(\w+))", [&db, &slowLog](const httplib::Request &req, httplib::Response &res){
+        SlowQueryLog::Scope query(slowLog, "queryField", req.matches[1]);
+        RequestSpan trace(db, req, res, "GET /queryField");
+        trace.profile = &query.profile;
+        string table = req.matches[1];
+        string field = req.get_param_value("field");
+        string value = req.get_param_value("value");
+        QueryOptions opts;
+        opts.ns = req.get_param_value("namespace");
+        opts.profile = &query.profile;
+        query.request = {{"field", field}, {"value", value}};
+        if (!opts.ns.empty()) query.request["namespace"] = opts.ns;
+        try {
+            bool explain = req.has_param("explain");
+            auto ids = db.queryField(table,field,value,opts.ns,opts.profile);
+            queryResponse(res, ids, opts, explain);
+        } catch(exception &e){
+            query.error = e.what();
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
 
-    void saveAllTables() {
-        shared_lock<shared_mutex> lock(dbMutex);
-        for (auto &p : tables) {
-            saveTable(p.first);
-            saveIndex(p.first);
+    svr.Post(R"(/queryEmbedding/(\w+))", [&db, &slowLog](const httplib::Request &req, httplib::Response &res){
+        SlowQueryLog::Scope query(slowLog, "queryEmbedding", req.matches[1]);
+        RequestSpan trace(db, req, res, "POST /queryEmbedding");
+        trace.profile = &query.profile;
+        try {
+            string table = req.matches[1];
+            query.request = json::parse(req.body);
+            auto &j = query.request;
+            vector<float> emb = j["embedding"].get<vector<float>>();
+            int topK = j.value("topK",3);
+            auto opts = queryOptions(j);
+            bool explain = j.value("explain", false);
+            query.profile.stage("parse");
+            opts.profile = &query.profile;
+            auto ids = db.queryEmbedding(table,emb,topK,opts);
+            bool budgeted = j.contains("budget") || j.contains("patience");
+            queryResponse(res, ids, opts, explain, budgeted ? searchStatsJson(opts.profile->search, opts.search) : json());
+        } catch(exception &e){
+            query.error = e.what();
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
-    }
+    });
 
-public:
-    MidDB() {
-        fs::create_directories(storageDir);
-        for (auto &p : fs::directory_iterator(storageDir))
-            if (p.path().extension() == ".json")
-                loadTable(p.path().stem().string());
-        workerThread = thread([this]{ worker(); });
-    }
+    svr.Post(R"(/queryGrouped/(\w+))", [&db, &slowLog](const httplib::Request &req, httplib::Response &res){
+        SlowQueryLog::Scope query(slowLog, "queryGrouped", req.matches[1]);
+        RequestSpan trace(db, req, res, "POST /queryGrouped");
+        trace.profile = &query.profile;
+        try {
+            string table = req.matches[1];
+            query.request = json::parse(req.body);
+            auto &j = query.request;
+            vector<float> emb = j["embedding"].get<vector<float>>();
+            string groupBy = j.at("groupBy").get<string>();
+            auto opts = queryOptions(j);
+            bool explain = j.value("explain", false);
+            query.profile.stage("parse");
+            opts.profile = &query.profile;
+            auto groups = db.queryGrouped(table,emb,groupBy,j.value("groups",10),j.value("perGroup",3),opts);
+            queryResponse(res, groups, opts, explain, nullptr, "groups");
+        } catch(exception &e){
+            query.error = e.what();
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
 
-    ~MidDB() {
-        {
-            lock_guard<mutex> lock(queueMutex);
-            stopWorker = true;
+    svr.Post(R"(/queryEmbeddingBatch/(\w+))", [&db, &slowLog](const httplib::Request &req, httplib::Response &res){
+        SlowQueryLog::Scope query(slowLog, "queryEmbeddingBatch", req.matches[1]);
+        RequestSpan trace(db, req, res, "POST /queryEmbeddingBatch");
+        trace.profile = &query.profile;
+        try {
+            string table = req.matches[1];
+            query.request = json::parse(req.body);
+            auto &j = query.request;
+            auto embeddings = j["embeddings"].get<vector<vector<float>>>();
+            int topK = j.value("topK",3);
+            auto opts = queryOptions(j);
+            bool explain = j.value("explain", false);
+            query.profile.stage("parse");
+            opts.profile = &query.profile;
+            auto ids = db.queryEmbeddingBatch(table,embeddings,topK,opts);
+            queryResponse(res, ids, opts, explain);
+        } catch(exception &e){
+            query.error = e.what();
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
-        cv.notify_all();
-        if(workerThread.joinable()) workerThread.join();
-    }
+    });
 
-    void createTable(const string &tableName, int dim = 0) {
-        if (tables.find(tableName) != tables.end()) return;
-        Table t; t.dim = dim;
-        tables[tableName] = std::move(t);
-    }
+    svr.Post(R"(/queryHybrid/(\w+))", [&db, &slowLog](const httplib::Request &req, httplib::Response &res){
+        SlowQueryLog::Scope query(slowLog, "queryHybrid", req.matches[1]);
+        RequestSpan trace(db, req, res, "POST /queryHybrid");
+        trace.profile = &query.profile;
+        try {
+            string table = req.matches[1];
+            query.request = json::parse(req.body);
+            auto &j = query.request;
+            string field = j["field"];
+            string value = j["value"];
+            vector<float> emb = j["embedding"].get<vector<float>>();
+            int topK = j.value("topK",3);
+            auto opts = queryOptions(j);
+            bool explain = j.value("explain", false);
+            query.profile.stage("parse");
+            opts.profile = &query.profile;
+            auto ids = db.queryHybrid(table,field,value,emb,topK,opts);
+            queryResponse(res, ids, opts, explain);
+        } catch(exception &e){
+            query.error = e.what();
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
 
-    void insert(const string &tableName, const string &recordID,
-                const unordered_map<string,string> &fields,
-                const vector<float> &embedding) {
-        {
-            lock_guard<mutex> lock(queueMutex);
-            insertQueue.push({tableName, recordID, fields, embedding});
+    svr.Post(R"(/buildDiskIndex/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            auto j = req.body.empty() ? json::object() : json::parse(req.body);
+            DiskGraphIndex::Params params;
+            params.R = j.value("R", params.R);
+            params.L = j.value("L", params.L);
+            params.alpha = j.value("alpha", params.alpha);
+            params.pqChunks = j.value("pqChunks", params.pqChunks);
+            res.set_content(db.buildDiskIndex(req.matches[1], params).dump(),"application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
-        cv.notify_one();
-    }
+    });
 
-    void update(const string &tableName, const string &recordID,
-                const unordered_map<string,string> &fields,
-                const vector<float> &embedding) {
-        insert(tableName, recordID, fields, embedding); // upsert via insert
-    }
+    svr.Post(R"(/tuneEf/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            res.set_content(db.tuneEf(req.matches[1]).dump(),"application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
 
-    void remove(const string &tableName, const string &recordID) {
-        unique_lock<shared_mutex> lock(dbMutex);
-        if (tables.find(tableName) == tables.end()) return;
-        auto &table = tables[tableName];
-        auto it = table.records.find(recordID);
-        if (it == table.records.end()) return;
+    svr.Post(R"(/reorder/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            res.set_content(db.reorderTable(req.matches[1]).dump(),"application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
 
-        size_t label = it->second.label;
-        // Remove from main records
-        table.records.erase(it);
-        table.labelToID.erase(label);
+    // --- Table Settings ---
+    svr.Get(R"(/tableConfig/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        res.set_content(db.tableConfig(req.matches[1]).dump(),"application/json");
+    });
 
-        // Remove from structured index
-        for (auto &[key,val] : it->second.fields) {
-            auto fIt = table.fieldIndex.find(key);
-            if(fIt != table.fieldIndex.end()) {
-                auto vIt = fIt->second.find(val);
-                if(vIt != fIt->second.end()) vIt->second.erase(recordID);
-            }
+    svr.Post(R"(/tableConfig/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            res.set_content(db.configureTable(req.matches[1], json::parse(req.body)).dump(),"application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
+    });
 
-        // Soft delete from HNSW (ghost label will exist)
-        if(table.index) table.index->markDelete(label);
-
-        cout << "[INFO] Deleted " << recordID << " from " << tableName << "\n";
-    }
+    svr.Post(R"(/knnGraph/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        RequestSpan trace(db, req, res, "POST /knnGraph");
+        try {
+            auto j = req.body.empty() ? json::object() : json::parse(req.body);
+            auto id = db.startKnnGraph(req.matches[1], j.value("target", ""), j.value("k", 10), j.value("ef", (size_t)0),
+                                       trace.span);
+            res.set_content(json{{"job", id}}.dump(),"application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
 
-    vector<string> queryField(const string &tableName, const string &field, const string &value) const {
-        vector<string> result;
-        shared_lock<shared_mutex> lock(dbMutex);
-        if (tables.find(tableName) == tables.end()) return result;
-        const auto &table = tables.at(tableName);
-        auto fit = table.fieldIndex.find(field);
-        if (fit != table.fieldIndex.end()) {
-            auto vit = fit->second.find(value);
-            if (vit != fit->second.end()) {
-                result.reserve(vit->second.size());
-                for (const auto &id : vit->second) result.push_back(id);
-                sort(result.begin(), result.end());
-            }
+    svr.Post(R"(/cluster/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        RequestSpan trace(db, req, res, "POST /cluster");
+        try {
+            auto j = req.body.empty() ? json::object() : json::parse(req.body);
+            auto id = db.startCluster(req.matches[1], j.value("namespace", ""), j.value("k", 16),
+                                      j.value("iterations", 100), j.value("batchSize", 1024), j.value("field", "cluster"),
+                                      trace.span);
+            res.set_content(json{{"job", id}}.dump(),"application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
-        return result;
-    }
+    });
 
-    vector<string> queryEmbedding(const string &tableName, const vector<float> &embedding, int topK=3) const {
-        vector<string> result;
-        shared_lock<shared_mutex> lock(dbMutex);
-        if (tables.find(tableName) == tables.end()) return result;
-        const auto &table = tables.at(tableName);
-        if (!table.index) return result;
+    svr.Get("/jobs", [&db](const httplib::Request &req, httplib::Response &res){
+        RequestSpan trace(db, req, res, "GET /jobs");
+        res.set_content(db.listJobs().dump(),"application/json");
+    });
 
-        auto labels = table.index->searchKnn(embedding.data(), topK);
-        while (!labels.empty()) {
-            auto item = labels.top(); labels.pop();
-            auto it = table.labelToID.find(item.second);
-            if (it != table.labelToID.end()) result.push_back(it->second);
+    svr.Get(R"(/jobs/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        RequestSpan trace(db, req, res, "GET /jobs/<id>");
+        try {
+            res.set_content(db.jobStatus(req.matches[1]).dump(),"application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
-        return result;
-    }
+    });
 
-    vector<string> queryHybrid(const string &tableName,
-                               const string &field, const string &value,
-                               const vector<float> &embedding, int topK=3) const {
-        auto filteredIDs = queryField(tableName, field, value);
-        if (filteredIDs.empty()) return {};
+    svr.Post(R"(/jobs/(\w+)/cancel)", [&db](const httplib::Request &req, httplib::Response &res){
+        RequestSpan trace(db, req, res, "POST /jobs/<id>/cancel");
+        try {
+            res.set_content(db.cancelJob(req.matches[1]).dump(),"application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
 
-        auto candidateIDs = queryEmbedding(tableName, embedding, topK*10);
-        unordered_set<string> filterSet(filteredIDs.begin(), filteredIDs.end());
+    svr.Post(R"(/subscribe/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            auto j = json::parse(req.body);
+            auto id = db.subscribe(req.matches[1], j.at("embedding").get<vector<float>>(),
+                                   j.at("maxDistance").get<float>(), j.value("namespace", ""));
+            res.set_content(json{{"subscription", id}}.dump(), "application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
 
-        vector<string> final;
-        for (auto &id : candidateIDs)
-            if (filterSet.count(id)) final.push_back(id);
-        if (final.size() > (size_t)topK) final.resize(topK);
-        return final;
-    }
+    svr.Get("/subscriptions", [&db](const httplib::Request &, httplib::Response &res){
+        res.set_content(db.listSubscriptions().dump(), "application/json");
+    });
 
-    void saveTable(const string &tableName) {
-        auto &table = tables[tableName];
-        json j;
-        for (auto &[id, rec] : table.records) {
-            j[id]["fields"] = rec.fields;
-            j[id]["embedding"] = rec.embedding;
-            j[id]["label"] = rec.label;
+    svr.Get(R"(/subscriptions/(\d+))", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            size_t limit = req.has_param("limit") ? stoul(req.get_param_value("limit")) : 1000;
+            int wait = req.has_param("wait") ? stoi(req.get_param_value("wait")) : 0;
+            auto matches = db.subscriptionMatches(stoul(req.matches[1]), limit, chrono::milliseconds(wait));
+            res.set_content(json{{"matches", matches}}.dump(), "application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
-        ofstream out(tableFile(tableName));
-        out << j.dump(2);
-    }
-
-    void saveIndex(const string &tableName) {
-        auto &table = tables[tableName];
-        if (table.index) table.index->saveIndex(indexFile(tableName));
-    }
+    });
 
-    void loadTable(const string &tableName) {
-        ifstream in(tableFile(tableName));
-        if (!in.is_open()) return;
+    // Server-sent events; the stream ends when the subscription is cancelled
+    svr.Get(R"(/subscriptions/(\d+)/stream)", [&db](const httplib::Request &req, httplib::Response &res){
+        size_t id = stoul(req.matches[1]);
+        int heartbeat = req.has_param("heartbeat") ? stoi(req.get_param_value("heartbeat")) : 15000;
+        res.set_chunked_content_provider("text/event-stream", [&db, id, heartbeat](size_t, httplib::DataSink &sink){
+            vector<json> matches;
+            try { matches = db.subscriptionMatches(id, 100, chrono::milliseconds(heartbeat)); }
+            catch (exception &) { sink.done(); return false; }
+            string out = matches.empty() ? ": keepalive\n\n" : "";
+            for (auto &m : matches) out += "data: " + m.dump() + "\n\n";
+            return sink.write(out.data(), out.size());
+        });
+    });
 
-        json j; in >> j;
-        Table t;
-        for (auto &[id, rec] : j.items()) {
-            Record r;
-            r.fields = rec["fields"].get<unordered_map<string,string>>();
-            r.embedding = rec["embedding"].get<vector<float>>();
-            r.label = rec["label"].get<size_t>();
-            t.records[id] = r;
-            t.labelToID[r.label] = id;
-            for (auto &[key,val] : r.fields)
-                t.fieldIndex[key][val].insert(id);
-            if (t.dim==0) t.dim = r.embedding.size();
-            if (r.label >= t.nextLabel) t.nextLabel = r.label+1;
+    svr.Post(R"(/subscriptions/(\d+)/cancel)", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            res.set_content(db.cancelSubscription(stoul(req.matches[1])).dump(), "application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
-        if (ifstream(indexFile(tableName)).good() && t.dim>0) {
-            auto space = new hnswlib::L2Space(t.dim);
-            t.index.reset(new hnswlib::HierarchicalNSW<float>(space, indexFile(tableName)));
+    });
+
+    svr.Post(R"(/edges/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        RequestSpan trace(db, req, res, "POST /edges");
+        try {
+            auto j = json::parse(req.body);
+            vector<WriteOp> ops;
+            auto list = j.contains("edges") ? j["edges"] : json::array({j});
+            for (auto &e : list) {
+                WriteOp op;
+                op.kind = j.value("remove", false) ? WriteOp::RemoveEdge : WriteOp::AddEdge;
+                op.tableName = req.matches[1];
+                op.recordID = e.at("from").get<string>();
+                op.edgeType = e.at("type").get<string>();
+                op.target = e.at("to").get<string>();
+                ops.push_back(std::move(op));
+            }
+            writeResponse(db, db.submit(ops, trace.span), j, res, {{"edges", ops.size()}});
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
-        tables[tableName] = std::move(t);
-    }
-};
+    });
 
-// --- REST API ---
-int main() {
-    MidDB db;
-    httplib::Server svr;
+    svr.Get(R"(/neighbors/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        try {
+            json j = json::object();
+            for (auto key : {"type", "direction", "field", "value"})
+                if (req.has_param(key)) j[key] = req.get_param_value(key);
+            res.set_content(db.neighbors(req.matches[1], req.get_param_value("id"), edgeFilter(j)).dump(),"application/json");
+        } catch(exception &e){
+            res.status = 400;
+            res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
+        }
+    });
 
-    // --- CRUD Endpoints ---
-    svr.Post("/insert", [&db](const httplib::Request &req, httplib::Response &res){
+    svr.Post(R"(/traverse/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
         try {
             auto j = json::parse(req.body);
-            db.insert(j["table"], j["id"],
-                      j["fields"].get<unordered_map<string,string>>(),
-                      j["embedding"].get<vector<float>>());
-            res.set_content("{\"status\":\"ok\"}", "application/json");
+            auto start = j["start"].is_array() ? j["start"].get<vector<string>>() : vector<string>{j["start"].get<string>()};
+            auto out = db.traverse(req.matches[1], start, j.value("hops", 1), edgeFilter(j), j.value("limit", (size_t)1000));
+            res.set_content(out.dump(),"application/json");
         } catch(exception &e){
             res.status = 400;
             res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
     });
 
-    svr.Post("/update", [&db](const httplib::Request &req, httplib::Response &res){
+    svr.Post(R"(/queryExpand/(\w+))", [&db, &slowLog](const httplib::Request &req, httplib::Response &res){
+        SlowQueryLog::Scope query(slowLog, "queryExpand", req.matches[1]);
+        RequestSpan trace(db, req, res, "POST /queryExpand");
+        trace.profile = &query.profile;
         try {
-            auto j = json::parse(req.body);
-            db.update(j["table"], j["id"],
-                      j["fields"].get<unordered_map<string,string>>(),
-                      j["embedding"].get<vector<float>>());
-            res.set_content("{\"status\":\"ok\"}", "application/json");
+            query.request = json::parse(req.body);
+            auto &j = query.request;
+            vector<float> emb = j["embedding"].get<vector<float>>();
+            auto opts = queryOptions(j);
+            bool explain = j.value("explain", false);
+            query.profile.stage("parse");
+            opts.profile = &query.profile;
+            auto out = db.queryExpand(req.matches[1], emb, j.value("topK",3), j.value("hops", 1), edgeFilter(j),
+                                      j.value("limit", (size_t)1000), opts);
+            string body = out.dump();
+            query.profile.stage("serialize");
+            if (explain) body.insert(body.size() - 1, ",\"explain\":" + explainJson(query.profile).dump());
+            res.set_content(body,"application/json");
         } catch(exception &e){
+            query.error = e.what();
             res.status = 400;
             res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
     });
 
-    svr.Post("/delete", [&db](const httplib::Request &req, httplib::Response &res){
+    svr.Get(R"(/stats/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
         try {
-            auto j = json::parse(req.body);
-            db.remove(j["table"], j["id"]);
-            res.set_content("{\"status\":\"ok\"}", "application/json");
+            res.set_content(db.tableStats(req.matches[1]).dump(),"application/json");
         } catch(exception &e){
             res.status = 400;
             res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
     });
 
-    // --- Query Endpoints ---
-    svr.Get(R"(/queryField/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
-        string table = req.matches[1];
-        string field = req.get_param_value("field");
-        string value = req.get_param_value("value");
-        auto ids = db.queryField(table,field,value);
-        res.set_content(json(ids).dump(),"application/json");
+    svr.Get(R"(/namespaces/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+        res.set_content(db.listNamespaces(req.matches[1]).dump(),"application/json");
+    });
+
+    // --- Admin Endpoints ---
+    svr.Get("/admin/slowlog", [&slowLog](const httplib::Request &req, httplib::Response &res){
+        size_t limit = req.has_param("limit") ? stoul(req.get_param_value("limit")) : 100;
+        res.set_content(slowLog.list(req.get_param_value("kind"), limit).dump(), "application/json");
     });
 
-    svr.Post(R"(/queryEmbedding/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+    svr.Get("/admin/slowlog/config", [&slowLog](const httplib::Request &, httplib::Response &res){
+        res.set_content(slowLog.config().dump(), "application/json");
+    });
+
+    svr.Post("/admin/slowlog/config", [&slowLog](const httplib::Request &req, httplib::Response &res){
         try {
-            string table = req.matches[1];
-            auto j = json::parse(req.body);
-            vector<float> emb = j["embedding"].get<vector<float>>();
-            int topK = j.value("topK",3);
-            auto ids = db.queryEmbedding(table,emb,topK);
-            res.set_content(json(ids).dump(),"application/json");
+            res.set_content(slowLog.configure(json::parse(req.body)).dump(), "application/json");
         } catch(exception &e){
             res.status = 400;
             res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
     });
 
-    svr.Post(R"(/queryHybrid/(\w+))", [&db](const httplib::Request &req, httplib::Response &res){
+    svr.Get("/admin/trace", [&db](const httplib::Request &, httplib::Response &res){
+        res.set_content(db.tracing().config().dump(), "application/json");
+    });
+
+    svr.Post("/admin/trace", [&db](const httplib::Request &req, httplib::Response &res){
         try {
-            string table = req.matches[1];
-            auto j = json::parse(req.body);
-            string field = j["field"];
-            string value = j["value"];
-            vector<float> emb = j["embedding"].get<vector<float>>();
-            int topK = j.value("topK",3);
-            auto ids = db.queryHybrid(table,field,value,emb,topK);
-            res.set_content(json(ids).dump(),"application/json");
+            res.set_content(db.configureTracing(json::parse(req.body)).dump(), "application/json");
         } catch(exception &e){
             res.status = 400;
             res.set_content("{\"error\":\""+string(e.what())+"\"}", "application/json");
         }
     });
 
+    svr.Post("/admin/slowlog/clear", [&slowLog](const httplib::Request &, httplib::Response &res){
+        slowLog.clear();
+        res.set_content("{\"status\":\"ok\"}", "application/json");
+    });
+
+    cout << "[INFO] Distance kernels: " << isaName(cpuIsa) << "\n";
     cout << "MidDB (structured + semantic + hybrid) running at http://localhost:8080\n";
     svr.listen("0.0.0.0",8080);
 }